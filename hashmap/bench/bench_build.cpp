@@ -0,0 +1,67 @@
+// Time to build a HashMap from a key/value array: one hashmap_put2 at a
+// time, with and without hashmap_reserve, against hashmap_build_parallel
+// at 1..N threads.
+//
+//   ./bench_build [nkeys] [max_threads]
+//
+// Build with -DCMAKE_BUILD_TYPE=Release for meaningful numbers.
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+extern "C" {
+#include "hashmap.h"
+}
+
+typedef std::chrono::steady_clock Clock;
+
+static double seconds_since(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+int main(int argc, char** argv)
+{
+    int n = argc > 1 ? atoi(argv[1]) : 10000000;
+    int max_threads = argc > 2 ? atoi(argv[2]) : std::thread::hardware_concurrency();
+
+    std::vector<std::string> words;
+    std::vector<const char*> keys;
+    std::vector<int> lens;
+    std::vector<void*> vals;
+    words.reserve(n);
+    for (int i = 0; i < n; i++)
+        words.push_back("key " + std::to_string(i));
+    for (int i = 0; i < n; i++) {
+        keys.push_back(words[i].data());
+        lens.push_back(words[i].size());
+        vals.push_back((void*)(size_t)i);
+    }
+
+    printf("%d keys, seconds\n", n);
+
+    for (bool reserve : { false, true }) {
+        HashMap map = {};
+        auto start = Clock::now();
+        if (reserve)
+            hashmap_reserve(&map, n);
+        for (int i = 0; i < n; i++)
+            hashmap_put2(&map, keys[i], lens[i], vals[i]);
+        printf("%-20s %8.3f\n", reserve ? "put2 + reserve" : "put2", seconds_since(start));
+        hashmap_free(&map);
+    }
+
+    for (int t = 1; t <= max_threads; t *= 2) {
+        auto start = Clock::now();
+        HashMap* map = hashmap_build_parallel(keys.data(), lens.data(), vals.data(), n, t);
+        double s = seconds_since(start);
+        printf("parallel %2d threads  %8.3f\n", t, s);
+        hashmap_free(map);
+        free(map);
+        if (t < max_threads && t * 2 > max_threads)
+            t = max_threads / 2;
+    }
+    return 0;
+}
@@ -0,0 +1,110 @@
+// Multi-threaded throughput of ConcurrentHashMap against a HashMap wrapped
+// in one global mutex, for 1..N threads.
+//
+//   ./bench_concurrent [max_threads] [write_percent]
+//
+// Build with -DCMAKE_BUILD_TYPE=Release for meaningful numbers.
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+extern "C" {
+#include "hashmap.h"
+}
+
+#define NKEYS 1000000
+#define DURATION 0.5
+
+static std::vector<std::string> keys;
+
+struct MutexMap {
+    std::mutex lock;
+    HashMap map = {};
+
+    void* get(const std::string& k)
+    {
+        std::lock_guard<std::mutex> g(lock);
+        return hashmap_get2(&map, k.data(), k.size());
+    }
+
+    void put(const std::string& k, void* v)
+    {
+        std::lock_guard<std::mutex> g(lock);
+        hashmap_put2(&map, k.data(), k.size(), v);
+    }
+};
+
+struct ShardedMap {
+    ConcurrentHashMap* map = hashmap_concurrent_new(0);
+
+    ~ShardedMap() { hashmap_concurrent_free(map); }
+
+    void* get(const std::string& k) { return hashmap_concurrent_get2(map, k.data(), k.size()); }
+
+    void put(const std::string& k, void* v) { hashmap_concurrent_put2(map, k.data(), k.size(), v); }
+};
+
+// Returns millions of operations per second over all threads.
+template <class Map>
+static double run(Map& map, int nthreads, int write_percent)
+{
+    std::atomic<bool> stop(false);
+    std::atomic<long> total(0);
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < nthreads; t++) {
+        threads.emplace_back([&, t] {
+            std::mt19937_64 rng(t);
+            long ops = 0;
+            while (!stop.load(std::memory_order_relaxed)) {
+                for (int i = 0; i < 256; i++) {
+                    const std::string& k = keys[rng() % NKEYS];
+                    if ((int)(rng() % 100) < write_percent)
+                        map.put(k, (void*)(size_t)i);
+                    else
+                        map.get(k);
+                }
+                ops += 256;
+            }
+            total += ops;
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(DURATION));
+    stop = true;
+    for (auto& th : threads)
+        th.join();
+    return total / DURATION / 1e6;
+}
+
+int main(int argc, char** argv)
+{
+    int max_threads = argc > 1 ? atoi(argv[1]) : std::thread::hardware_concurrency();
+    int write_percent = argc > 2 ? atoi(argv[2]) : 10;
+
+    for (int i = 0; i < NKEYS; i++)
+        keys.push_back("key " + std::to_string(i));
+
+    MutexMap locked;
+    ShardedMap sharded;
+    for (int i = 0; i < NKEYS; i++) {
+        locked.put(keys[i], (void*)(size_t)i);
+        sharded.put(keys[i], (void*)(size_t)i);
+    }
+
+    printf("%d keys, %d%% writes, Mops/s\n", NKEYS, write_percent);
+    printf("threads      mutex  concurrent\n");
+    for (int n = 1; n <= max_threads; n *= 2) {
+        double a = run(locked, n, write_percent);
+        double b = run(sharded, n, write_percent);
+        printf("%7d %10.2f %11.2f\n", n, a, b);
+        if (n < max_threads && n * 2 > max_threads)
+            n = max_threads / 2;
+    }
+    return 0;
+}
@@ -0,0 +1,199 @@
+// Compares the hash functions HashMap can use: hashing throughput and the
+// probe-length distribution each one produces in a real table.
+//
+//   ./bench_hash [nkeys]
+//
+// Build with -DCMAKE_BUILD_TYPE=Release for meaningful throughput numbers.
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+extern "C" {
+#include "hashmap_internal.h"
+}
+
+struct KeySet {
+    const char* name;
+    std::vector<std::string> keys;
+};
+
+struct HashFunc {
+    const char* name;
+    HashFn fn;
+};
+
+static KeySet sequential_keys(int n)
+{
+    KeySet set = { "seq", {} };
+    for (int i = 0; i < n; i++)
+        set.keys.push_back("key " + std::to_string(i));
+    return set;
+}
+
+static KeySet identifier_keys(int n, std::mt19937_64& rng)
+{
+    static const char alpha[] = "abcdefghijklmnopqrstuvwxyz_ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    KeySet set = { "ident", {} };
+    for (int i = 0; i < n; i++) {
+        std::string s;
+        int len = 6 + rng() % 19;
+        for (int j = 0; j < len; j++)
+            s += alpha[rng() % (j == 0 ? 53 : sizeof(alpha) - 1)];
+        set.keys.push_back(s);
+    }
+    return set;
+}
+
+// 32-200 byte keys with long shared prefixes.
+static KeySet url_keys(int n, std::mt19937_64& rng)
+{
+    static const char* hosts[] = { "https://example.com", "https://api.example.org/v2", "http://static.cdn.example.net" };
+    KeySet set = { "url", {} };
+    for (int i = 0; i < n; i++) {
+        std::string s = hosts[rng() % 3];
+        int segments = 1 + rng() % 8;
+        for (int j = 0; j < segments; j++)
+            s += "/segment" + std::to_string(rng() % 1000);
+        s += "?id=" + std::to_string(i);
+        if (s.size() > 200)
+            s.resize(200);
+        set.keys.push_back(s);
+    }
+    return set;
+}
+
+// 8-byte binary integers, as produced by callers keying on ids.
+static KeySet integer_keys(int n)
+{
+    KeySet set = { "u64", {} };
+    for (uint64_t i = 0; i < (uint64_t)n; i++)
+        set.keys.push_back(std::string((const char*)&i, sizeof(i)));
+    return set;
+}
+
+static double hash_throughput(const KeySet& set, HashFn fn)
+{
+    size_t bytes = 0;
+    for (auto& k : set.keys)
+        bytes += k.size();
+
+    uint64_t sink = 0;
+    size_t total = 0;
+    auto start = std::chrono::steady_clock::now();
+    double elapsed;
+    do {
+        for (auto& k : set.keys)
+            sink += fn(k.data(), k.size());
+        total += bytes;
+        elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    } while (elapsed < 0.2);
+
+    if (sink == 42)
+        printf(" ");
+    return total / elapsed / 1e9;
+}
+
+// Number of groups a lookup of `hash` visits before reaching group `target`.
+static int groups_to(HashMap* map, uint64_t hash, size_t target)
+{
+    size_t gmask = map->capacity / HASHMAP_GROUP_WIDTH - 1;
+    size_t g = hashmap_hash_group(hash) & gmask;
+    for (size_t i = 0; i <= gmask; i++) {
+        if (g == target)
+            return i + 1;
+        g = (g + i + 1) & gmask;
+    }
+    return -1;
+}
+
+// Number of groups a lookup of an absent key with `hash` visits.
+static int groups_to_miss(HashMap* map, uint64_t hash)
+{
+    size_t gmask = map->capacity / HASHMAP_GROUP_WIDTH - 1;
+    size_t g = hashmap_hash_group(hash) & gmask;
+    for (size_t i = 0; i <= gmask; i++) {
+        if (hashmap_group_match_empty(&map->ctrl[g * HASHMAP_GROUP_WIDTH]))
+            return i + 1;
+        g = (g + i + 1) & gmask;
+    }
+    return gmask + 1;
+}
+
+#define MAX_PROBE 5
+
+static void print_histogram(const char* what, const std::vector<long>& hist, long total)
+{
+    printf("    %-5s", what);
+    for (int i = 1; i <= MAX_PROBE; i++)
+        printf(" %7.3f%%", 100.0 * hist[i] / total);
+    printf("\n");
+}
+
+// Fills a map up to just below HIGH_WATERMARK, where probe sequences are
+// longest, and reports how many groups hits and misses visit.
+static void probe_lengths(const KeySet& set, HashFn fn)
+{
+    HashMap map = {};
+    map.hash_fn = fn;
+    for (auto& k : set.keys) {
+        if (map.used >= (int)set.keys.size() / 2 && map.used * 100 >= 69 * map.capacity)
+            break;
+        hashmap_put2(&map, k.data(), k.size(), (void*)1);
+    }
+
+    std::vector<long> hits(MAX_PROBE + 1), misses(MAX_PROBE + 1);
+    long nhits = 0;
+    for (int i = 0; i < map.capacity; i++) {
+        if (map.ctrl[i] & HASHMAP_CTRL_EMPTY)
+            continue;
+        int n = groups_to(&map, map.buckets[i].hash, i / HASHMAP_GROUP_WIDTH);
+        hits[n < MAX_PROBE ? n : MAX_PROBE]++;
+        nhits++;
+    }
+
+    long nmisses = 0;
+    for (auto& k : set.keys) {
+        std::string absent = k + "#";
+        int n = groups_to_miss(&map, fn(absent.data(), absent.size()));
+        misses[n < MAX_PROBE ? n : MAX_PROBE]++;
+        nmisses++;
+    }
+
+    printf("    load %.1f%%, groups probed:       1         2         3         4        5+\n",
+        100.0 * nhits / map.capacity);
+    print_histogram("hit", hits, nhits);
+    print_histogram("miss", misses, nmisses);
+
+    hashmap_free(&map);
+}
+
+int main(int argc, char** argv)
+{
+    int n = argc > 1 ? atoi(argv[1]) : 200000;
+    std::mt19937_64 rng(12345);
+
+    std::vector<KeySet> sets = {
+        sequential_keys(n),
+        identifier_keys(n, rng),
+        url_keys(n, rng),
+        integer_keys(n),
+    };
+    std::vector<HashFunc> funcs = {
+        { "fnv", hashmap_fnv_hash },
+        { "wyhash", hashmap_wyhash },
+    };
+
+    for (auto& set : sets) {
+        size_t bytes = 0;
+        for (auto& k : set.keys)
+            bytes += k.size();
+        printf("%s: %d keys, %.1f bytes/key\n", set.name, n, (double)bytes / n);
+        for (auto& f : funcs) {
+            printf("  %-7s %6.2f GB/s\n", f.name, hash_throughput(set, f.fn));
+            probe_lengths(set, f.fn);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,358 @@
+// Single-threaded HashMap and kaleido::HashMap performance against
+// std::unordered_map: insert, hit, miss and delete throughput plus
+// per-operation latency percentiles, for tables from L1-sized up to
+// several times L3, at several load factors, with uniform and Zipfian
+// lookups. hashmap_get_batch is measured next to plain gets on the same
+// keys.
+//
+//   ./bench_hashmap [--quick] > results.json
+//
+// Results go to stdout as JSON; a readable summary goes to stderr.
+// --quick only runs the two smallest sizes with fewer rounds, for smoke
+// testing.
+// Build with -DCMAKE_BUILD_TYPE=Release for meaningful numbers.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+extern "C" {
+#include "hashmap.h"
+}
+#include "hashmap.hpp"
+
+// Lookups per config, spread over repeated rounds for small tables.
+#define MIN_OPS 2000000
+#define BATCH 256
+#define ZIPF_S 0.99
+
+typedef std::chrono::steady_clock Clock;
+
+// Keys are distinct 8-byte integers, laid out contiguously so both maps
+// see the same key memory. Absent keys come from the same bijection.
+static uint64_t splitmix(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    return x ^ (x >> 31);
+}
+
+struct CMap {
+    static constexpr const char* name = "hashmap";
+    HashMap map = {};
+
+    // Fixes the bucket count so the table sits at the requested load.
+    explicit CMap(int capacity, int bloom_bits = 0)
+    {
+        map.bloom_bits = bloom_bits;
+        map.high_watermark = 95;
+        map.low_watermark = 90;
+        hashmap_reserve(&map, capacity * 9 / 10);
+    }
+    ~CMap() { hashmap_free(&map); }
+
+    void put(const uint64_t* k, void* v) { hashmap_put2(&map, (const char*)k, 8, v); }
+    void* get(const uint64_t* k) { return hashmap_get2(&map, (const char*)k, 8); }
+    void del(const uint64_t* k) { hashmap_delete2(&map, (const char*)k, 8); }
+    size_t capacity() { return map.capacity; }
+};
+
+// With the Bloom pre-filter, which should mostly help misses.
+struct BloomMap : CMap {
+    static constexpr const char* name = "hashmap+bloom";
+
+    explicit BloomMap(int capacity)
+        : CMap(capacity, 10)
+    {
+    }
+};
+
+// The C++ template on the same keys, as integers rather than bytes.
+struct TemplateMap {
+    static constexpr const char* name = "kaleido::HashMap";
+    kaleido::HashMap<uint64_t, void*> map;
+
+    explicit TemplateMap(int capacity)
+    {
+        map.set_watermarks(95, 90);
+        map.reserve(capacity * 9 / 10);
+    }
+
+    void put(const uint64_t* k, void* v) { map.insert_or_assign(*k, v); }
+    void* get(const uint64_t* k)
+    {
+        void** v = map.find(*k);
+        return v ? *v : nullptr;
+    }
+    void del(const uint64_t* k) { map.erase(*k); }
+    size_t capacity() { return map.capacity(); }
+};
+
+struct StdMap {
+    static constexpr const char* name = "std::unordered_map";
+    std::unordered_map<std::string_view, void*> map;
+
+    explicit StdMap(int capacity) { map.reserve(capacity * 9 / 10); }
+
+    void put(const uint64_t* k, void* v) { map[std::string_view((const char*)k, 8)] = v; }
+    void* get(const uint64_t* k)
+    {
+        auto it = map.find(std::string_view((const char*)k, 8));
+        return it == map.end() ? nullptr : it->second;
+    }
+    void del(const uint64_t* k) { map.erase(std::string_view((const char*)k, 8)); }
+    size_t capacity() { return map.bucket_count(); }
+};
+
+struct OpResult {
+    double mops;
+    double p50, p99, p999;
+};
+
+struct Config {
+    const char* size_class;
+    int capacity;
+    double load;
+    const char* dist;
+};
+
+static volatile uintptr_t sink;
+static double clock_overhead;
+static int min_ops = MIN_OPS;
+
+static double seconds_since(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static long cache_size(int name, long fallback)
+{
+    long n = sysconf(name);
+    return n > 0 ? n : fallback;
+}
+
+// Cost of a back-to-back pair of clock reads, subtracted from latencies.
+static double measure_clock_overhead()
+{
+    std::vector<double> v(100000);
+    for (auto& x : v) {
+        auto a = Clock::now();
+        auto b = Clock::now();
+        x = std::chrono::duration<double, std::nano>(b - a).count();
+    }
+    std::nth_element(v.begin(), v.begin() + v.size() / 2, v.end());
+    return v[v.size() / 2];
+}
+
+static void percentiles(std::vector<double>& ns, OpResult& r)
+{
+    std::sort(ns.begin(), ns.end());
+    auto at = [&](double q) { return std::max(0.0, ns[(size_t)(q * (ns.size() - 1))] - clock_overhead); };
+    r.p50 = at(0.5);
+    r.p99 = at(0.99);
+    r.p999 = at(0.999);
+}
+
+// Indices into `n` keys: a shuffled permutation for uniform access, or
+// Zipf(ZIPF_S)-distributed ranks mapped through a shuffle so the hot keys
+// are scattered over the table.
+static std::vector<int> access_order(int n, int count, bool zipf, std::mt19937_64& rng)
+{
+    std::vector<int> perm(n);
+    for (int i = 0; i < n; i++)
+        perm[i] = i;
+    std::shuffle(perm.begin(), perm.end(), rng);
+
+    std::vector<int> order(count);
+    if (!zipf) {
+        for (int i = 0; i < count; i++)
+            order[i] = perm[i % n];
+        return order;
+    }
+
+    std::vector<double> cdf(n);
+    double sum = 0;
+    for (int i = 0; i < n; i++)
+        cdf[i] = sum += 1.0 / std::pow(i + 1, ZIPF_S);
+    std::uniform_real_distribution<double> u(0, sum);
+    for (int i = 0; i < count; i++) {
+        int rank = std::lower_bound(cdf.begin(), cdf.end(), u(rng)) - cdf.begin();
+        order[i] = perm[std::min(rank, n - 1)];
+    }
+    return order;
+}
+
+// Runs `op` over `order` and returns Mops/s. With `lat` set, every
+// operation is timed on its own instead.
+template <class Op>
+static double run_ops(const std::vector<int>& order, Op op, std::vector<double>* lat)
+{
+    if (lat) {
+        lat->clear();
+        for (int i : order) {
+            auto a = Clock::now();
+            op(i);
+            auto b = Clock::now();
+            lat->push_back(std::chrono::duration<double, std::nano>(b - a).count());
+        }
+        return 0;
+    }
+    auto start = Clock::now();
+    for (int i : order)
+        op(i);
+    return order.size() / seconds_since(start) / 1e6;
+}
+
+// One pass over all phases. Inserts and deletes always visit every key
+// once in shuffled order; hits and misses follow the configured
+// distribution.
+template <class Map>
+static void run_phases(const Config& cfg, const std::vector<uint64_t>& keys, const std::vector<uint64_t>& absent,
+    const std::vector<int>& fill, const std::vector<int>& hits, const std::vector<int>& misses,
+    std::vector<OpResult>& res, bool latency, size_t* capacity)
+{
+    std::vector<double> lat;
+    std::vector<double>* lp = latency ? &lat : nullptr;
+    auto record = [&](OpResult& r, double mops) {
+        if (latency)
+            percentiles(lat, r);
+        else
+            r.mops = std::max(r.mops, mops);
+    };
+
+    Map map(cfg.capacity);
+    record(res[0], run_ops(fill, [&](int i) { map.put(&keys[i], (void*)(uintptr_t)(i + 1)); }, lp));
+    *capacity = map.capacity();
+    record(res[1], run_ops(hits, [&](int i) { sink += (uintptr_t)map.get(&keys[i]); }, lp));
+    record(res[2], run_ops(misses, [&](int i) { sink += (uintptr_t)map.get(&absent[i]); }, lp));
+    record(res[3], run_ops(fill, [&](int i) { map.del(&keys[i]); }, lp));
+}
+
+// Plain gets against hashmap_get_batch on the same hit sequence.
+static double run_batch(const Config& cfg, const std::vector<uint64_t>& keys, const std::vector<int>& hits)
+{
+    CMap map(cfg.capacity);
+    int n = cfg.capacity * cfg.load;
+    for (int i = 0; i < n; i++)
+        map.put(&keys[i], (void*)(uintptr_t)(i + 1));
+
+    std::vector<const char*> ptrs(hits.size());
+    std::vector<int> lens(hits.size(), 8);
+    std::vector<void*> vals(BATCH);
+    for (size_t i = 0; i < hits.size(); i++)
+        ptrs[i] = (const char*)&keys[hits[i]];
+
+    auto start = Clock::now();
+    for (size_t i = 0; i < hits.size(); i += BATCH) {
+        int len = std::min((size_t)BATCH, hits.size() - i);
+        hashmap_get_batch(&map.map, &ptrs[i], &lens[i], len, vals.data());
+        sink += (uintptr_t)vals[0];
+    }
+    return hits.size() / seconds_since(start) / 1e6;
+}
+
+static const char* op_names[] = { "insert", "hit", "miss", "delete" };
+
+template <class Map>
+static void bench(const Config& cfg, const std::vector<uint64_t>& keys, const std::vector<uint64_t>& absent,
+    std::mt19937_64& rng, bool& first)
+{
+    int n = cfg.capacity * cfg.load;
+    int rounds = std::max(1, min_ops / n);
+    bool zipf = strcmp(cfg.dist, "zipf") == 0;
+    std::vector<int> fill = access_order(n, n, false, rng);
+    std::vector<int> hits = access_order(n, n, zipf, rng);
+    std::vector<int> misses = access_order(n, n, zipf, rng);
+
+    std::vector<OpResult> res(4);
+    size_t capacity = 0;
+    for (int r = 0; r < rounds; r++)
+        run_phases<Map>(cfg, keys, absent, fill, hits, misses, res, false, &capacity);
+    run_phases<Map>(cfg, keys, absent, fill, hits, misses, res, true, &capacity);
+
+    double batch = 0;
+    if constexpr (std::is_same_v<Map, CMap>) {
+        for (int r = 0; r < rounds; r++)
+            batch = std::max(batch, run_batch(cfg, keys, hits));
+    }
+
+    printf("%s\n    {\"impl\": \"%s\", \"size_class\": \"%s\", \"keys\": %d, \"capacity\": %zu, "
+           "\"load\": %.3f, \"dist\": \"%s\", \"ops\": {",
+        first ? "" : ",", Map::name, cfg.size_class, n, capacity, cfg.load, cfg.dist);
+    for (int i = 0; i < 4; i++)
+        printf("%s\"%s\": {\"mops\": %.3f, \"p50_ns\": %.1f, \"p99_ns\": %.1f, \"p999_ns\": %.1f}",
+            i ? ", " : "", op_names[i], res[i].mops, res[i].p50, res[i].p99, res[i].p999);
+    if (batch)
+        printf(", \"get_batch\": {\"mops\": %.3f}", batch);
+    printf("}}");
+    first = false;
+
+    fprintf(stderr, "%-19s %-3s %9d keys  load %.2f  %-7s", Map::name, cfg.size_class, n, cfg.load, cfg.dist);
+    for (int i = 0; i < 4; i++)
+        fprintf(stderr, "  %s %7.2f", op_names[i], res[i].mops);
+    if (batch)
+        fprintf(stderr, "  batch %7.2f", batch);
+    fprintf(stderr, " Mops/s\n");
+}
+
+int main(int argc, char** argv)
+{
+    bool quick = argc > 1 && strcmp(argv[1], "--quick") == 0;
+    if (quick)
+        min_ops = MIN_OPS / 20;
+
+    long l1 = cache_size(_SC_LEVEL1_DCACHE_SIZE, 32 << 10);
+    long l2 = cache_size(_SC_LEVEL2_CACHE_SIZE, 1 << 20);
+    long l3 = cache_size(_SC_LEVEL3_CACHE_SIZE, 32 << 20);
+    clock_overhead = measure_clock_overhead();
+
+    // Table sizes: the largest power-of-two bucket count whose entries and
+    // control bytes fit in the target footprint.
+    struct {
+        const char* name;
+        long bytes;
+    } sizes[] = { { "L1", l1 }, { "L2", l2 }, { "L3", l3 }, { "4L3", 4 * l3 } };
+    int nsizes = quick ? 2 : 4;
+    double loads[] = { 0.25, 0.5, 0.75, 0.875 };
+    const char* dists[] = { "uniform", "zipf" };
+
+    int max_cap = 64;
+    while ((size_t)max_cap * 2 * (sizeof(HashEntry) + 1) <= (size_t)sizes[nsizes - 1].bytes)
+        max_cap *= 2;
+    std::vector<uint64_t> keys(max_cap), absent(max_cap);
+    for (int i = 0; i < max_cap; i++) {
+        keys[i] = splitmix(i);
+        absent[i] = splitmix(max_cap + i);
+    }
+
+    printf("{\n  \"cache\": {\"l1\": %ld, \"l2\": %ld, \"l3\": %ld},\n", l1, l2, l3);
+    printf("  \"clock_overhead_ns\": %.1f,\n  \"results\": [", clock_overhead);
+
+    std::mt19937_64 rng(12345);
+    bool first = true;
+    for (int s = 0; s < nsizes; s++) {
+        int cap = 64;
+        while ((size_t)cap * 2 * (sizeof(HashEntry) + 1) <= (size_t)sizes[s].bytes)
+            cap *= 2;
+        for (double load : loads) {
+            for (const char* dist : dists) {
+                Config cfg = { sizes[s].name, cap, load, dist };
+                bench<CMap>(cfg, keys, absent, rng, first);
+                bench<BloomMap>(cfg, keys, absent, rng, first);
+                bench<TemplateMap>(cfg, keys, absent, rng, first);
+                bench<StdMap>(cfg, keys, absent, rng, first);
+            }
+        }
+    }
+    printf("\n  ]\n}\n");
+    return 0;
+}
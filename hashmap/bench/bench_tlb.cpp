@@ -0,0 +1,100 @@
+// Random lookups into a large HashMap with each page policy, reporting
+// time and data-TLB misses per lookup. TLB misses are read with
+// perf_event_open and shown as n/a where that is not permitted (see
+// /proc/sys/kernel/perf_event_paranoid).
+//
+//   ./bench_tlb [nkeys]
+//
+// HASHMAP_PAGES_HUGETLB needs pages in the pool, e.g.
+//   echo 1024 > /proc/sys/vm/nr_hugepages
+// and falls back to transparent huge pages otherwise.
+// Build with -DCMAKE_BUILD_TYPE=Release for meaningful numbers.
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <random>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+extern "C" {
+#include "hashmap.h"
+}
+
+#define NLOOKUPS 10000000
+
+static int open_dtlb_counter()
+{
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+int main(int argc, char** argv)
+{
+    int n = argc > 1 ? atoi(argv[1]) : 8000000;
+
+    std::vector<uint64_t> keys(n);
+    for (int i = 0; i < n; i++)
+        keys[i] = i * 0x9e3779b97f4a7c15ull;
+    std::mt19937_64 rng(1);
+    std::vector<int> order(NLOOKUPS);
+    for (auto& i : order)
+        i = rng() % n;
+
+    int fd = open_dtlb_counter();
+    struct {
+        const char* name;
+        HashMapPages pages;
+    } policies[] = {
+        { "default", HASHMAP_PAGES_DEFAULT },
+        { "thp", HASHMAP_PAGES_THP },
+        { "hugetlb", HASHMAP_PAGES_HUGETLB },
+    };
+
+    printf("%d keys, %d random lookups\n", n, NLOOKUPS);
+    printf("pages       ns/lookup  dTLB misses/lookup\n");
+    for (auto& p : policies) {
+        HashMap map = {};
+        map.pages = p.pages;
+        hashmap_reserve(&map, n);
+        for (int i = 0; i < n; i++)
+            hashmap_put2(&map, (const char*)&keys[i], 8, (void*)(size_t)(i + 1));
+
+        uint64_t sink = 0;
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+        auto start = std::chrono::steady_clock::now();
+        for (int i : order)
+            sink += (size_t)hashmap_get2(&map, (const char*)&keys[i], 8);
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        uint64_t misses = 0;
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(fd, &misses, sizeof(misses)) != sizeof(misses))
+                misses = 0;
+        }
+
+        printf("%-10s %10.1f", p.name, ns / NLOOKUPS);
+        if (fd >= 0)
+            printf(" %19.3f\n", (double)misses / NLOOKUPS);
+        else
+            printf(" %19s\n", "n/a");
+        if (sink == 42)
+            printf(" ");
+        hashmap_free(&map);
+    }
+    if (fd >= 0)
+        close(fd);
+    return 0;
+}
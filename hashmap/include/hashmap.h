@@ -23,30 +23,238 @@
 char* format(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
 
 // noreturn void error(char* fmt, ...) __attribute__((format(printf, 1, 2)));
-void error(const char* fmt, ...) __attribute__((format(printf, 1, 2))) __attribute__((noreturn));
+void error(const char* fmt, ...) __attribute__((format(printf, 1, 2))) __attribute__((__noreturn__));
 // void error(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
 // void error(char *fmt, ...) __attribute__((format(printf, 1, 2)));
 
 #define unreachable() \
     error("internal error at %s:%d", __FILE__, __LINE__)
 
+// Hashes `keylen` bytes of `key`. A map's hash function must not change
+// while it holds keys.
+typedef uint64_t (*HashFn)(const char* key, int keylen);
+
+typedef struct HashMapArena HashMapArena;
+typedef struct HashMapBloom HashMapBloom;
+typedef struct HashMapImage HashMapImage;
+
+#ifdef HASHMAP_STATS
+// Probe-length histograms have this many slots; the last one also counts
+// all longer probes.
+#define HASHMAP_PROBE_HIST 16
+
+typedef struct {
+    // hit_probes[n] counts successful lookups that visited n groups (n
+    // buckets with Robin Hood probing); miss_probes the unsuccessful ones.
+    uint64_t hit_probes[HASHMAP_PROBE_HIST];
+    uint64_t miss_probes[HASHMAP_PROBE_HIST];
+    uint64_t rehashes;
+    uint64_t rehash_ns;
+    // Lookups checked against the Bloom filter, those it turned away,
+    // and those it let through for keys that were not there.
+    uint64_t bloom_queries;
+    uint64_t bloom_rejects;
+    uint64_t bloom_false_positives;
+} HashMapCounters;
+
+typedef struct {
+    int live;
+    int tombstones;
+    int capacity;
+    double load_factor;
+    uint64_t hit_probes[HASHMAP_PROBE_HIST];
+    uint64_t miss_probes[HASHMAP_PROBE_HIST];
+    uint64_t rehashes;
+    double rehash_seconds;
+    uint64_t bloom_queries;
+    uint64_t bloom_rejects;
+    uint64_t bloom_false_positives;
+    size_t bytes_allocated;
+} HashMapStats;
+#endif
+
+typedef enum {
+    // Swiss-table style: control bytes are scanned 16 at a time.
+    HASHMAP_GROUPS,
+    // Robin Hood linear probing with backward-shift deletion. Probe
+    // sequences stay short and deletes leave no tombstones, which suits
+    // maps under constant insert/delete churn.
+    HASHMAP_ROBIN_HOOD,
+} HashMapProbing;
+
+// Where the bucket and control arrays of a map come from. Page policies
+// only apply to arrays of 2 MiB and more; smaller ones are malloc'd.
+typedef enum {
+    HASHMAP_PAGES_DEFAULT,
+    // Transparent huge pages: arrays are 2 MiB-aligned and madvised.
+    HASHMAP_PAGES_THP,
+    // Explicit huge pages (MAP_HUGETLB) from the hugetlbfs pool, falling
+    // back to transparent huge pages when the pool is exhausted.
+    HASHMAP_PAGES_HUGETLB,
+} HashMapPages;
+
+typedef enum {
+    // Pages go to the node of the thread that first touches them.
+    HASHMAP_NUMA_DEFAULT,
+    // All pages on `numa_node`.
+    HASHMAP_NUMA_BIND,
+    // Pages spread round-robin over all nodes, for tables shared by
+    // threads on every socket.
+    HASHMAP_NUMA_INTERLEAVE,
+} HashMapNuma;
+
+// Keys of up to this many bytes are stored inside the entry by maps with
+// owned_keys set.
+#define HASHMAP_INLINE_KEY 16
+
 typedef struct {
-    char* key;
+    union {
+        char* key;
+        char inline_key[HASHMAP_INLINE_KEY];
+    };
     int keylen;
     void* val;
+    uint64_t hash;
 } HashEntry;
 
 typedef struct {
     HashEntry* buckets;
+    // One control byte per bucket: HASHMAP_CTRL_EMPTY,
+    // HASHMAP_CTRL_DELETED, or the low 7 bits of the key's hash when the
+    // bucket is in use.
+    uint8_t* ctrl;
     int capacity;
     int used;
+
+    // Hash function for keys. NULL selects hashmap_wyhash; set it to
+    // hashmap_fnv_hash for the original hash, or to any HashFn.
+    HashFn hash_fn;
+
+    // Probing scheme. Like hash_fn, it must be set while the map is empty.
+    HashMapProbing probing;
+
+    // Load factors in percent. The table grows once `used` reaches the
+    // high watermark and is sized to stay below the low one afterwards.
+    // Zero selects the defaults of 70 and 50, as does any pair outside
+    // 0 < low < high <= 95.
+    int high_watermark;
+    int low_watermark;
+
+    // Set to grow the table incrementally: the previous bucket array is
+    // kept as the old table and drained a few buckets per operation
+    // instead of being rehashed in a single put.
+    bool incremental;
+    HashEntry* old_buckets;
+    uint8_t* old_ctrl;
+    int old_capacity;
+    int migrate_pos;
+
+    // Set to have the map copy keys, so callers need not keep them alive.
+    // Short keys are stored inline, longer ones in `arena`, which
+    // hashmap_free releases in one go. Must be set while the map is empty.
+    bool owned_keys;
+    HashMapArena* arena;
+
+    // Page size and NUMA placement of large tables, for multi-GB maps
+    // whose random probes miss the TLB and the local node. Must be set
+    // while the map is empty.
+    HashMapPages pages;
+    HashMapNuma numa;
+    int numa_node;
+
+    // Bits per key of a Bloom filter that lets lookups of absent keys
+    // skip probing, for miss-heavy workloads; zero (the default) disables
+    // it. About 10 bits per key turn away 99% of misses. Must be set
+    // while the map is empty.
+    int bloom_bits;
+    HashMapBloom* bloom;
+
+    // Set for an insertion-ordered map. Entries then live in `entries`,
+    // dense and in insertion order, and each bucket in use holds only a
+    // 4-byte offset into it in `index`, so iteration walks live entries
+    // instead of every bucket. Deleted entries leave holes that the next
+    // rehash squeezes out. Needs HASHMAP_GROUPS probing and no
+    // incremental growth. Must be set while the map is empty.
+    bool ordered;
+    uint32_t* index;
+    HashEntry* entries;
+    int nentries; // including holes
+    int entries_capacity;
+    int holes;
+
+    // Set for maps opened with hashmap_open_mmap, which are read-only.
+    HashMapImage* image;
+
+#ifdef HASHMAP_STATS
+    HashMapCounters counters;
+#endif
 } HashMap;
 
 void* hashmap_get(HashMap* map, const char* key);
 void* hashmap_get2(HashMap* map, const char* key, int keylen);
+void hashmap_get_batch(HashMap* map, const char* const* keys, const int* lens, int n, void** vals);
 void hashmap_put(HashMap* map, const char* key, void* val);
 void hashmap_put2(HashMap* map, const char* key, int keylen, void* val);
+// Returns the value slot for a key, inserting the key with a NULL value
+// first if needed; `inserted` (which may be NULL) tells which happened.
+// The slot is valid until the next call on the map: while an incremental
+// map is migrating, lookups move entries as well.
+void** hashmap_slot(HashMap* map, const char* key, int keylen, bool* inserted);
 void hashmap_delete(HashMap* map, const char* key);
 void hashmap_delete2(HashMap* map, const char* key, int keylen);
+void hashmap_free(HashMap* map);
+void hashmap_reserve(HashMap* map, int n);
+void hashmap_shrink_to_fit(HashMap* map);
+
+// Iteration over all keys, in insertion order for ordered maps and in no
+// particular order otherwise. The map must not be modified while an
+// iterator is in use.
+typedef struct {
+    HashMap* map;
+    int pos;
+} HashMapIter;
+
+void hashmap_iter_init(HashMap* map, HashMapIter* it);
+// Returns false once every key has been visited. Any of `key`, `keylen`
+// and `val` may be NULL.
+bool hashmap_iter_next(HashMapIter* it, const char** key, int* keylen, void** val);
+
+// Snapshots. hashmap_save writes the table and key bytes to a file that
+// hashmap_open_mmap maps read-only and serves lookups from directly, so
+// opening costs O(1) and processes mapping the same file share its pages.
+// Values are stored as the raw pointer bits, so they should encode data
+// (integers, offsets) rather than point into the saving process. Maps
+// with a custom hash_fn cannot be saved. Both return -1/NULL with errno
+// set on failure. Release an opened map with hashmap_free, then free.
+int hashmap_save(HashMap* map, const char* path);
+HashMap* hashmap_open_mmap(const char* path);
+
+// Builds a map of `n` keys with `nthreads` threads (0 for one per CPU).
+// Keys are not copied and must outlive the map; for duplicate keys the
+// last value wins, as with hashmap_put2. The result is an ordinary map;
+// release it with hashmap_free, then free.
+HashMap* hashmap_build_parallel(const char* const* keys, const int* lens, void* const* vals, int n, int nthreads);
+
+#ifdef HASHMAP_STATS
+void hashmap_stats(HashMap* map, HashMapStats* stats);
+#endif
 void hashmap_test(void);
+
+uint64_t hashmap_fnv_hash(const char* key, int keylen);
+uint64_t hashmap_wyhash(const char* key, int keylen);
+
+// A thread-safe variant of HashMap. Keys are split across independently
+// locked shards; gets take no locks and never wait for a shard that is
+// growing. As with HashMap, keys are not copied, and a deleted key must
+// stay readable until no get can still be running on it.
+typedef struct ConcurrentHashMap ConcurrentHashMap;
+
+ConcurrentHashMap* hashmap_concurrent_new(int nshards);
+void hashmap_concurrent_free(ConcurrentHashMap* map);
+void* hashmap_concurrent_get(ConcurrentHashMap* map, const char* key);
+void* hashmap_concurrent_get2(ConcurrentHashMap* map, const char* key, int keylen);
+void hashmap_concurrent_put(ConcurrentHashMap* map, const char* key, void* val);
+void hashmap_concurrent_put2(ConcurrentHashMap* map, const char* key, int keylen, void* val);
+void hashmap_concurrent_delete(ConcurrentHashMap* map, const char* key);
+void hashmap_concurrent_delete2(ConcurrentHashMap* map, const char* key, int keylen);
 #endif // HASHMAP_H
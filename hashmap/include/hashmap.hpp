@@ -0,0 +1,342 @@
+#ifndef HASHMAP_HPP
+#define HASHMAP_HPP
+
+// kaleido::HashMap<K, V, Hash, Eq> is a header-only C++ front-end to the
+// same open-addressing engine as the C HashMap: control-byte groups
+// probed 16 at a time, tombstones on delete and the same watermarks. It
+// differs in that keys and values are stored inline and typed, so integer
+// keys need no formatting, no strlen and no memcmp, and hashing and
+// equality are resolved at compile time.
+//
+//   kaleido::HashMap<uint64_t, Record> map;
+//   map.try_emplace(id, name, size);
+//   if (Record* r = map.find(id))
+//       ...
+//
+// Like the C map, pointers returned by find() and emplace() are only
+// valid until the next insertion.
+
+#include <cstdlib>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#include "hashmap_group.h"
+
+namespace kaleido {
+
+// The default hash. Integers, enums and pointers get a single multiply
+// mix; other trivially copyable types without padding hash their bytes;
+// strings hash their characters. All use the C map's wyhash constants.
+template <class K, class = void>
+struct Hash;
+
+template <class K>
+struct Hash<K, std::enable_if_t<std::is_integral_v<K> || std::is_enum_v<K> || std::is_pointer_v<K>>> {
+    uint64_t operator()(K key) const
+    {
+        uint64_t x;
+        if constexpr (std::is_pointer_v<K>)
+            x = (uintptr_t)key;
+        else
+            x = (uint64_t)key;
+        return hashmap_wy_mix(x ^ hashmap_wy_secret[0], hashmap_wy_secret[1]);
+    }
+};
+
+template <class K>
+struct Hash<K, std::enable_if_t<std::is_class_v<K> && std::is_trivially_copyable_v<K>
+                   && std::has_unique_object_representations_v<K>>> {
+    uint64_t operator()(const K& key) const { return hashmap_wyhash_inline((const char*)&key, sizeof(K)); }
+};
+
+template <>
+struct Hash<std::string_view> {
+    uint64_t operator()(std::string_view key) const { return hashmap_wyhash_inline(key.data(), key.size()); }
+};
+
+template <>
+struct Hash<std::string> {
+    uint64_t operator()(const std::string& key) const { return hashmap_wyhash_inline(key.data(), key.size()); }
+};
+
+// The default equality. Padding-free trivially copyable structs compare
+// as bytes, which compiles to a few word compares; everything else
+// uses operator==.
+template <class K>
+struct Equal {
+    bool operator()(const K& a, const K& b) const
+    {
+        if constexpr (std::is_class_v<K> && std::is_trivially_copyable_v<K>
+            && std::has_unique_object_representations_v<K>)
+            return memcmp(&a, &b, sizeof(K)) == 0;
+        else
+            return a == b;
+    }
+};
+
+template <class K, class V, class HashFn = Hash<K>, class Eq = Equal<K>>
+class HashMap {
+public:
+    struct Slot {
+        K key;
+        V value;
+    };
+
+    HashMap() = default;
+
+    HashMap(HashMap&& other) noexcept { swap(other); }
+
+    HashMap& operator=(HashMap&& other) noexcept
+    {
+        HashMap tmp(std::move(other));
+        swap(tmp);
+        return *this;
+    }
+
+    HashMap(const HashMap&) = delete;
+    HashMap& operator=(const HashMap&) = delete;
+
+    ~HashMap()
+    {
+        destroy_slots();
+        free_table(slots_, ctrl_);
+    }
+
+    int size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    int capacity() const { return capacity_; }
+
+    // Rehash when buckets in use (live or deleted) reach `high` percent,
+    // growing so that live keys stay below `low` percent, as the C map's
+    // watermarks do.
+    void set_watermarks(int high, int low)
+    {
+        if (high > 95 || low <= 0 || low >= high)
+            throw std::invalid_argument("kaleido::HashMap: bad watermarks");
+        high_ = high;
+        low_ = low;
+    }
+
+    V* find(const K& key)
+    {
+        int i = find_index(key, hash_(key));
+        return i < 0 ? nullptr : &slots_[i].value;
+    }
+
+    const V* find(const K& key) const { return const_cast<HashMap*>(this)->find(key); }
+
+    bool contains(const K& key) const { return find(key) != nullptr; }
+
+    // Inserts `key` with a value constructed from `args` if the key is
+    // absent. The arguments are left untouched if the key exists.
+    template <class KK, class... Args>
+    std::pair<V*, bool> try_emplace(KK&& key, Args&&... args)
+    {
+        uint64_t hash = hash_(key);
+        int i = find_index(key, hash);
+        if (i >= 0)
+            return { &slots_[i].value, false };
+        i = claim(hash);
+        new (&slots_[i]) Slot { K(std::forward<KK>(key)), V(std::forward<Args>(args)...) };
+        commit(i, hash);
+        return { &slots_[i].value, true };
+    }
+
+    // Inserts a ready-made key and value, moving them into the table if
+    // the key is absent.
+    template <class KK, class VV>
+    std::pair<V*, bool> emplace(KK&& key, VV&& value)
+    {
+        return try_emplace(std::forward<KK>(key), std::forward<VV>(value));
+    }
+
+    template <class VV>
+    V* insert_or_assign(const K& key, VV&& value)
+    {
+        auto [v, inserted] = try_emplace(key, std::forward<VV>(value));
+        if (!inserted)
+            *v = std::forward<VV>(value);
+        return v;
+    }
+
+    V& operator[](const K& key) { return *try_emplace(key).first; }
+
+    bool erase(const K& key)
+    {
+        int i = find_index(key, hash_(key));
+        if (i < 0)
+            return false;
+        slots_[i].~Slot();
+        size_--;
+
+        // Same shortcut as the C map: a bucket in a group that still has
+        // an empty slot never stopped a probe, so it can become empty.
+        if (hashmap_group_match_empty(&ctrl_[i & ~(HASHMAP_GROUP_WIDTH - 1)])) {
+            ctrl_[i] = HASHMAP_CTRL_EMPTY;
+            used_--;
+        } else {
+            ctrl_[i] = HASHMAP_CTRL_DELETED;
+        }
+        return true;
+    }
+
+    void clear()
+    {
+        destroy_slots();
+        if (ctrl_)
+            memset(ctrl_, HASHMAP_CTRL_EMPTY, capacity_);
+        size_ = used_ = 0;
+    }
+
+    // Makes room for `n` keys without rehashing.
+    void reserve(int n)
+    {
+        int cap = capacity_for(n, high_);
+        if (cap > capacity_)
+            rehash(cap);
+    }
+
+    template <class F>
+    void for_each(F f)
+    {
+        for (int i = 0; i < capacity_; i++)
+            if (!(ctrl_[i] & HASHMAP_CTRL_EMPTY))
+                f(slots_[i].key, slots_[i].value);
+    }
+
+    void swap(HashMap& other) noexcept
+    {
+        std::swap(slots_, other.slots_);
+        std::swap(ctrl_, other.ctrl_);
+        std::swap(capacity_, other.capacity_);
+        std::swap(size_, other.size_);
+        std::swap(used_, other.used_);
+        std::swap(high_, other.high_);
+        std::swap(low_, other.low_);
+    }
+
+private:
+    static constexpr int init_size = 16;
+
+    Slot* slots_ = nullptr;
+    uint8_t* ctrl_ = nullptr;
+    int capacity_ = 0;
+    int size_ = 0; // live keys
+    int used_ = 0; // live keys and tombstones
+    int high_ = 70;
+    int low_ = 50;
+    [[no_unique_address]] HashFn hash_;
+    [[no_unique_address]] Eq eq_;
+
+    int find_index(const K& key, uint64_t hash) const
+    {
+        if (!ctrl_)
+            return -1;
+        uint8_t tag = hashmap_hash_tag(hash);
+        size_t gmask = capacity_ / HASHMAP_GROUP_WIDTH - 1;
+        size_t g = hashmap_hash_group(hash) & gmask;
+
+        for (size_t i = 0; i <= gmask; i++) {
+            const uint8_t* group = &ctrl_[g * HASHMAP_GROUP_WIDTH];
+            for (uint32_t m = hashmap_group_match(group, tag); m; m &= m - 1) {
+                int idx = g * HASHMAP_GROUP_WIDTH + __builtin_ctz(m);
+                if (eq_(slots_[idx].key, key))
+                    return idx;
+            }
+            if (hashmap_group_match_empty(group))
+                return -1;
+            g = (g + i + 1) & gmask;
+        }
+        return -1;
+    }
+
+    // Returns a free bucket for `hash`, growing the table first if it is
+    // at the high watermark. The caller constructs the slot and then
+    // calls commit(), so a throwing constructor leaves the map unchanged.
+    int claim(uint64_t hash)
+    {
+        if (!ctrl_ || (int64_t)used_ * 100 >= (int64_t)capacity_ * high_)
+            rehash(capacity_for(size_ + 1, low_));
+        return free_bucket(hash);
+    }
+
+    void commit(int i, uint64_t hash)
+    {
+        if (ctrl_[i] == HASHMAP_CTRL_EMPTY)
+            used_++;
+        ctrl_[i] = hashmap_hash_tag(hash);
+        size_++;
+    }
+
+    int free_bucket(uint64_t hash) const
+    {
+        size_t gmask = capacity_ / HASHMAP_GROUP_WIDTH - 1;
+        size_t g = hashmap_hash_group(hash) & gmask;
+        for (size_t i = 0; i <= gmask; i++) {
+            uint32_t m = hashmap_group_match_free(&ctrl_[g * HASHMAP_GROUP_WIDTH]);
+            if (m)
+                return g * HASHMAP_GROUP_WIDTH + __builtin_ctz(m);
+            g = (g + i + 1) & gmask;
+        }
+        __builtin_unreachable();
+    }
+
+    int capacity_for(int n, int watermark) const
+    {
+        int cap = capacity_ ? capacity_ : init_size;
+        while ((int64_t)n * 100 >= (int64_t)cap * watermark)
+            cap *= 2;
+        return cap;
+    }
+
+    // Moves every live slot into a fresh table of `cap` buckets. Keys are
+    // rehashed rather than stored with their hash, which for the integer
+    // keys this template is aimed at costs one multiply.
+    void rehash(int cap)
+    {
+        Slot* old_slots = slots_;
+        uint8_t* old_ctrl = ctrl_;
+        int old_cap = capacity_;
+
+        slots_ = static_cast<Slot*>(::operator new(sizeof(Slot) * cap, std::align_val_t(alignof(Slot))));
+        ctrl_ = static_cast<uint8_t*>(std::aligned_alloc(HASHMAP_GROUP_WIDTH, cap));
+        memset(ctrl_, HASHMAP_CTRL_EMPTY, cap);
+        capacity_ = cap;
+        used_ = size_;
+
+        for (int i = 0; i < old_cap; i++) {
+            if (old_ctrl[i] & HASHMAP_CTRL_EMPTY)
+                continue;
+            uint64_t hash = hash_(old_slots[i].key);
+            int j = free_bucket(hash);
+            new (&slots_[j]) Slot(std::move(old_slots[i]));
+            old_slots[i].~Slot();
+            ctrl_[j] = hashmap_hash_tag(hash);
+        }
+        free_table(old_slots, old_ctrl);
+    }
+
+    void destroy_slots()
+    {
+        if constexpr (!std::is_trivially_destructible_v<Slot>) {
+            for (int i = 0; i < capacity_; i++)
+                if (!(ctrl_[i] & HASHMAP_CTRL_EMPTY))
+                    slots_[i].~Slot();
+        }
+    }
+
+    static void free_table(Slot* slots, uint8_t* ctrl)
+    {
+        if (slots)
+            ::operator delete(slots, std::align_val_t(alignof(Slot)));
+        std::free(ctrl);
+    }
+};
+
+} // namespace kaleido
+
+#endif // HASHMAP_HPP
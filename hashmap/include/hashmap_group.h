@@ -0,0 +1,143 @@
+#ifndef HASHMAP_GROUP_H
+#define HASHMAP_GROUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Control-byte groups and the default hash, shared by the C HashMap and
+// the C++ kaleido::HashMap in hashmap.hpp.
+
+// Control byte values. Tags of buckets in use never have the top bit set.
+#define HASHMAP_CTRL_EMPTY ((uint8_t)0x80)
+#define HASHMAP_CTRL_DELETED ((uint8_t)0xFE)
+
+// Number of control bytes probed at once. The capacity is always a
+// power of two and at least this large, so probing only ever masks the
+// hash and never divides by the capacity.
+#define HASHMAP_GROUP_WIDTH 16
+
+// The low 7 bits of a hash are stored in the control byte, the remaining
+// bits select the group where probing starts.
+static inline uint8_t hashmap_hash_tag(uint64_t hash)
+{
+    return hash & 0x7f;
+}
+
+static inline size_t hashmap_hash_group(uint64_t hash)
+{
+    return hash >> 7;
+}
+
+// Returns a bitmask with bit i set if the i-th control byte of the group
+// equals `tag`.
+static inline uint32_t hashmap_group_match(const uint8_t* ctrl, uint8_t tag)
+{
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i*)ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(tag)));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < HASHMAP_GROUP_WIDTH; i++)
+        mask |= (uint32_t)(ctrl[i] == tag) << i;
+    return mask;
+#endif
+}
+
+static inline uint32_t hashmap_group_match_empty(const uint8_t* ctrl)
+{
+    return hashmap_group_match(ctrl, HASHMAP_CTRL_EMPTY);
+}
+
+// Returns a bitmask of the buckets that are empty or deleted.
+static inline uint32_t hashmap_group_match_free(const uint8_t* ctrl)
+{
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)ctrl));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < HASHMAP_GROUP_WIDTH; i++)
+        mask |= (uint32_t)(ctrl[i] >> 7) << i;
+    return mask;
+#endif
+}
+
+// wyhash-style 64-bit hash: keys are consumed 8 or 16 bytes at a time and
+// mixed with 64x64->128 bit multiplies, which is several times faster than
+// FNV's byte-serial multiply chain for keys longer than a few bytes.
+
+static const uint64_t hashmap_wy_secret[4] = {
+    0xa0761d6478bd642full,
+    0xe7037ed1a0b428dbull,
+    0x8ebc6af09c88c6e3ull,
+    0x589965cc75374cc3ull,
+};
+
+static inline uint64_t hashmap_wy_mix(uint64_t a, uint64_t b)
+{
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static inline uint64_t hashmap_wy_read8(const uint8_t* p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t hashmap_wy_read4(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint64_t hashmap_wyhash_inline(const char* key, int len)
+{
+    const uint8_t* p = (const uint8_t*)key;
+    size_t n = len;
+    uint64_t seed = hashmap_wy_mix(hashmap_wy_secret[0], hashmap_wy_secret[1]);
+    uint64_t a, b;
+
+    if (n <= 16) {
+        if (n >= 4) {
+            a = (hashmap_wy_read4(p) << 32) | hashmap_wy_read4(p + ((n >> 3) << 2));
+            b = (hashmap_wy_read4(p + n - 4) << 32) | hashmap_wy_read4(p + n - 4 - ((n >> 3) << 2));
+        } else if (n > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[n >> 1] << 8) | p[n - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = n;
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = hashmap_wy_mix(hashmap_wy_read8(p) ^ hashmap_wy_secret[1], hashmap_wy_read8(p + 8) ^ seed);
+                see1 = hashmap_wy_mix(hashmap_wy_read8(p + 16) ^ hashmap_wy_secret[2], hashmap_wy_read8(p + 24) ^ see1);
+                see2 = hashmap_wy_mix(hashmap_wy_read8(p + 32) ^ hashmap_wy_secret[3], hashmap_wy_read8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = hashmap_wy_mix(hashmap_wy_read8(p) ^ hashmap_wy_secret[1], hashmap_wy_read8(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = hashmap_wy_read8(p + i - 16);
+        b = hashmap_wy_read8(p + i - 8);
+    }
+
+    __uint128_t r = (__uint128_t)(a ^ hashmap_wy_secret[1]) * (b ^ seed);
+    return hashmap_wy_mix((uint64_t)r ^ hashmap_wy_secret[0] ^ n, (uint64_t)(r >> 64) ^ hashmap_wy_secret[1]);
+}
+
+#endif // HASHMAP_GROUP_H
@@ -0,0 +1,234 @@
+#include "hashmap_internal.h"
+#include <pthread.h>
+
+// Parallel bulk build.
+//
+// The table is sized for all keys up front, so it never rehashes. Every
+// key's probe sequence starts at the group picked by its hash, and the
+// groups are split into one contiguous region per thread, so the high
+// bits of that start group decide which thread inserts a key. A thread
+// only reads and writes control bytes and buckets in its own region and
+// needs no locks. Probing wraps around the table, so a key whose probe
+// runs out of its region (all groups it visited there were full) is
+// deferred; those are inserted afterwards with hashmap_put2, which
+// probes through the same full groups and carries on as usual.
+//
+// The phases are:
+//   1. each thread hashes a slice of the input and counts its keys per
+//      region;
+//   2. each thread scatters the indices of its slice into per-region
+//      runs, keeping input order, so later duplicates still win;
+//   3. each thread inserts the keys of its region;
+//   4. deferred keys are inserted serially.
+
+#define MIN_REGION_GROUPS 64
+
+typedef struct {
+    const char* const* keys;
+    const int* lens;
+    void* const* vals;
+    int n;
+    int nthreads;
+    HashMap* map;
+    uint64_t* hashes;
+    int* order; // key indices grouped by region
+    int* counts; // [thread][region] in phase 1, run offsets in phase 2
+    int* starts; // first index of each region in `order`
+    int* deferred; // per region, at most its number of keys
+    int* ndeferred;
+    int* placed; // new keys per region
+    pthread_barrier_t barrier;
+} BuildJob;
+
+typedef struct {
+    BuildJob* job;
+    int id;
+} BuildThread;
+
+static int region_of(BuildJob* job, size_t group)
+{
+    size_t ngroups = job->map->capacity / HASHMAP_GROUP_WIDTH;
+    return (uint64_t)group * job->nthreads / ngroups;
+}
+
+static void hash_and_count(BuildJob* job, int id)
+{
+    HashMap* map = job->map;
+    size_t gmask = map->capacity / HASHMAP_GROUP_WIDTH - 1;
+    int lo = (int64_t)job->n * id / job->nthreads;
+    int hi = (int64_t)job->n * (id + 1) / job->nthreads;
+    int* counts = &job->counts[id * job->nthreads];
+
+    for (int i = lo; i < hi; i++) {
+        uint64_t hash = hash_key(map, job->keys[i], job->lens[i]);
+        job->hashes[i] = hash;
+        counts[region_of(job, hashmap_hash_group(hash) & gmask)]++;
+    }
+}
+
+// Turns the per-thread counts into offsets into `order`: region-major,
+// then thread, which is input order within each region. Runs on one
+// thread between the barriers.
+static void prefix_sum(BuildJob* job)
+{
+    int t = job->nthreads;
+    int off = 0;
+    for (int r = 0; r < t; r++) {
+        job->starts[r] = off;
+        for (int id = 0; id < t; id++) {
+            int c = job->counts[id * t + r];
+            job->counts[id * t + r] = off;
+            off += c;
+        }
+    }
+    job->starts[t] = off;
+}
+
+static void scatter(BuildJob* job, int id)
+{
+    size_t gmask = job->map->capacity / HASHMAP_GROUP_WIDTH - 1;
+    int lo = (int64_t)job->n * id / job->nthreads;
+    int hi = (int64_t)job->n * (id + 1) / job->nthreads;
+    int* offsets = &job->counts[id * job->nthreads];
+
+    for (int i = lo; i < hi; i++)
+        job->order[offsets[region_of(job, hashmap_hash_group(job->hashes[i]) & gmask)]++] = i;
+}
+
+// Inserts or updates one key within region `r`, counting new keys in
+// `placed`. Returns false if the probe would leave the region.
+static bool fill_one(BuildJob* job, int r, int i, int* placed)
+{
+    HashMap* map = job->map;
+    uint64_t hash = job->hashes[i];
+    uint8_t tag = hashmap_hash_tag(hash);
+    size_t gmask = map->capacity / HASHMAP_GROUP_WIDTH - 1;
+    size_t g = hashmap_hash_group(hash) & gmask;
+
+    for (size_t step = 0; step <= gmask; step++) {
+        if (region_of(job, g) != r)
+            return false;
+        uint8_t* group = &map->ctrl[g * HASHMAP_GROUP_WIDTH];
+        for (uint32_t m = hashmap_group_match(group, tag); m; m &= m - 1) {
+            HashEntry* ent = &map->buckets[g * HASHMAP_GROUP_WIDTH + __builtin_ctz(m)];
+            if (ent->hash == hash && ent->keylen == job->lens[i] && memcmp(ent->key, job->keys[i], ent->keylen) == 0) {
+                ent->val = job->vals[i];
+                return true;
+            }
+        }
+        // Nothing is deleted during a build, so the free slots are empty.
+        uint32_t m = hashmap_group_match_empty(group);
+        if (m) {
+            size_t idx = g * HASHMAP_GROUP_WIDTH + __builtin_ctz(m);
+            HashEntry* ent = &map->buckets[idx];
+            ent->key = (char*)job->keys[i];
+            ent->keylen = job->lens[i];
+            ent->val = job->vals[i];
+            ent->hash = hash;
+            group[idx % HASHMAP_GROUP_WIDTH] = tag;
+            (*placed)++;
+            return true;
+        }
+        g = (g + step + 1) & gmask;
+    }
+    return false;
+}
+
+static void fill_region(BuildJob* job, int r)
+{
+    int lo = job->starts[r];
+    int hi = job->starts[r + 1];
+    int* deferred = &job->deferred[lo];
+    int nd = 0, placed = 0;
+
+    for (int k = lo; k < hi; k++)
+        if (!fill_one(job, r, job->order[k], &placed))
+            deferred[nd++] = job->order[k];
+    job->ndeferred[r] = nd;
+    job->placed[r] = placed;
+}
+
+static void* build_thread(void* arg)
+{
+    BuildThread* th = arg;
+    BuildJob* job = th->job;
+
+    hash_and_count(job, th->id);
+    if (pthread_barrier_wait(&job->barrier) == PTHREAD_BARRIER_SERIAL_THREAD)
+        prefix_sum(job);
+    pthread_barrier_wait(&job->barrier);
+    scatter(job, th->id);
+    pthread_barrier_wait(&job->barrier);
+    fill_region(job, th->id);
+    return NULL;
+}
+
+HashMap* hashmap_build_parallel(const char* const* keys, const int* lens, void* const* vals, int n, int nthreads)
+{
+    HashMap* map = calloc(1, sizeof(HashMap));
+    if (n <= 0)
+        return map;
+    hashmap_reserve(map, n);
+
+    // Small regions would defer most keys to the serial pass.
+    int ngroups = map->capacity / HASHMAP_GROUP_WIDTH;
+    if (nthreads <= 0)
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > ngroups / MIN_REGION_GROUPS)
+        nthreads = ngroups / MIN_REGION_GROUPS;
+    if (nthreads < 1)
+        nthreads = 1;
+
+    BuildJob job = {
+        .keys = keys,
+        .lens = lens,
+        .vals = vals,
+        .n = n,
+        .nthreads = nthreads,
+        .map = map,
+        .hashes = malloc(n * sizeof(uint64_t)),
+        .order = malloc(n * sizeof(int)),
+        .counts = calloc(nthreads * nthreads, sizeof(int)),
+        .starts = calloc(nthreads + 1, sizeof(int)),
+        .deferred = malloc(n * sizeof(int)),
+        .ndeferred = calloc(nthreads, sizeof(int)),
+        .placed = calloc(nthreads, sizeof(int)),
+    };
+    pthread_barrier_init(&job.barrier, NULL, nthreads);
+
+    BuildThread* threads = calloc(nthreads, sizeof(BuildThread));
+    pthread_t* tids = calloc(nthreads, sizeof(pthread_t));
+    for (int i = 0; i < nthreads; i++) {
+        threads[i] = (BuildThread) { &job, i };
+        if (i > 0)
+            pthread_create(&tids[i], NULL, build_thread, &threads[i]);
+    }
+    build_thread(&threads[0]);
+    for (int i = 1; i < nthreads; i++)
+        pthread_join(tids[i], NULL);
+
+    for (int r = 0; r < nthreads; r++)
+        map->used += job.placed[r];
+
+    // Deferred keys go in region order, which keeps input order for
+    // duplicates: copies of a key share a region.
+    for (int r = 0; r < nthreads; r++) {
+        int* deferred = &job.deferred[job.starts[r]];
+        for (int k = 0; k < job.ndeferred[r]; k++) {
+            int i = deferred[k];
+            hashmap_put2(map, keys[i], lens[i], vals[i]);
+        }
+    }
+
+    pthread_barrier_destroy(&job.barrier);
+    free(threads);
+    free(tids);
+    free(job.hashes);
+    free(job.order);
+    free(job.counts);
+    free(job.starts);
+    free(job.deferred);
+    free(job.ndeferred);
+    free(job.placed);
+    return map;
+}
@@ -0,0 +1,361 @@
+#include "hashmap_internal.h"
+#include <pthread.h>
+#include <stdatomic.h>
+
+// A thread-safe HashMap.
+//
+// The key space is split by the top bits of the hash into shards, each an
+// independent control-byte table with its own mutex. Writers take the
+// shard's mutex; readers never do.
+//
+// Readers are protected by a per-shard sequence counter (a seqlock). A
+// writer makes the counter odd while it changes a bucket in place and
+// even again afterwards. A reader snapshots the counter, probes, and
+// retries if the counter moved. Growing a shard builds the new table off
+// to the side and publishes it with a single pointer store, so readers
+// keep probing the old table meanwhile and never wait on a rehash.
+//
+// Replaced tables cannot be freed while a reader may still probe them.
+// They are kept on a per-shard list until hashmap_concurrent_free. Only
+// growth replaces a table, and tables double in size, so they add up to
+// less than the live table. A shard that fills up with tombstones but not
+// with keys keeps its table and has it rebuilt in place instead: the
+// rebuild happens off to the side and is copied back inside a write
+// section, so readers only wait for the copy.
+//
+// Fields that readers look at are accessed with relaxed atomics, the
+// counter orders them.
+
+#define DEFAULT_SHARDS 64
+
+typedef struct Table Table;
+struct Table {
+    HashEntry* buckets;
+    uint8_t* ctrl;
+    int capacity;
+    Table* retired;
+};
+
+typedef struct {
+    pthread_mutex_t lock;
+    _Atomic(Table*) table;
+    atomic_uint seq;
+    int used;
+} __attribute__((aligned(64))) Shard;
+
+struct ConcurrentHashMap {
+    int nshards;
+    int shift;
+    Shard* shards;
+};
+
+#ifdef __SSE2__
+#define cpu_relax() _mm_pause()
+#else
+#define cpu_relax() ((void)0)
+#endif
+
+#define load_relaxed(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+#define store_relaxed(p, v) __atomic_store_n(p, v, __ATOMIC_RELAXED)
+
+static Table* new_table(int cap)
+{
+    Table* t = calloc(1, sizeof(Table));
+    t->buckets = calloc(cap, sizeof(HashEntry));
+    t->ctrl = aligned_alloc(HASHMAP_GROUP_WIDTH, cap);
+    memset(t->ctrl, HASHMAP_CTRL_EMPTY, cap);
+    t->capacity = cap;
+    return t;
+}
+
+static void free_table(Table* t)
+{
+    free(t->buckets);
+    free(t->ctrl);
+    free(t);
+}
+
+static Shard* shard_for(ConcurrentHashMap* map, uint64_t hash)
+{
+    return &map->shards[map->shift == 64 ? 0 : hash >> map->shift];
+}
+
+// Copies a group of control bytes without tearing individual words.
+static inline void load_group(uint8_t* dst, const uint8_t* ctrl)
+{
+    uint64_t lo = load_relaxed((const uint64_t*)ctrl);
+    uint64_t hi = load_relaxed((const uint64_t*)(ctrl + 8));
+    memcpy(dst, &lo, 8);
+    memcpy(dst + 8, &hi, 8);
+}
+
+ConcurrentHashMap* hashmap_concurrent_new(int nshards)
+{
+    if (nshards <= 0)
+        nshards = DEFAULT_SHARDS;
+    int bits = 0;
+    while ((1 << bits) < nshards)
+        bits++;
+
+    ConcurrentHashMap* map = calloc(1, sizeof(ConcurrentHashMap));
+    map->nshards = 1 << bits;
+    map->shift = 64 - bits;
+    map->shards = aligned_alloc(64, map->nshards * sizeof(Shard));
+    for (int i = 0; i < map->nshards; i++) {
+        Shard* sh = &map->shards[i];
+        memset(sh, 0, sizeof(Shard));
+        pthread_mutex_init(&sh->lock, NULL);
+        atomic_init(&sh->table, new_table(INIT_SIZE));
+    }
+    return map;
+}
+
+void hashmap_concurrent_free(ConcurrentHashMap* map)
+{
+    for (int i = 0; i < map->nshards; i++) {
+        Shard* sh = &map->shards[i];
+        Table* t = atomic_load(&sh->table);
+        while (t) {
+            Table* next = t->retired;
+            free_table(t);
+            t = next;
+        }
+        pthread_mutex_destroy(&sh->lock);
+    }
+    free(map->shards);
+    free(map);
+}
+
+// Lock-free lookup. Every candidate entry is read into a local copy and
+// only compared once the sequence counter shows the copy is consistent,
+// so memcmp never runs on a half-written entry.
+static bool read_entry(Shard* sh, uint64_t hash, const char* key, int keylen, void** val)
+{
+    for (;;) {
+        unsigned seq = atomic_load_explicit(&sh->seq, memory_order_acquire);
+        if (seq & 1) {
+            cpu_relax();
+            continue;
+        }
+
+        Table* t = atomic_load_explicit(&sh->table, memory_order_acquire);
+        uint8_t tag = hashmap_hash_tag(hash);
+        size_t gmask = t->capacity / HASHMAP_GROUP_WIDTH - 1;
+        size_t g = hashmap_hash_group(hash) & gmask;
+        bool stale = false;
+
+        for (size_t i = 0; i <= gmask && !stale; i++) {
+            uint8_t group[HASHMAP_GROUP_WIDTH];
+            load_group(group, &t->ctrl[g * HASHMAP_GROUP_WIDTH]);
+
+            for (uint32_t m = hashmap_group_match(group, tag); m; m &= m - 1) {
+                HashEntry* ent = &t->buckets[g * HASHMAP_GROUP_WIDTH + __builtin_ctz(m)];
+                if (load_relaxed(&ent->hash) != hash || load_relaxed(&ent->keylen) != keylen)
+                    continue;
+                char* k = load_relaxed(&ent->key);
+                void* v = load_relaxed(&ent->val);
+
+                atomic_thread_fence(memory_order_acquire);
+                if (atomic_load_explicit(&sh->seq, memory_order_relaxed) != seq) {
+                    stale = true;
+                    break;
+                }
+                if (memcmp(k, key, keylen) == 0) {
+                    *val = v;
+                    return true;
+                }
+            }
+            if (stale || hashmap_group_match_empty(group))
+                break;
+            g = (g + i + 1) & gmask;
+        }
+
+        atomic_thread_fence(memory_order_acquire);
+        if (!stale && atomic_load_explicit(&sh->seq, memory_order_relaxed) == seq)
+            return false;
+    }
+}
+
+// Writer-side lookup, called with the shard locked.
+static HashEntry* find_locked(Table* t, uint64_t hash, const char* key, int keylen)
+{
+    uint8_t tag = hashmap_hash_tag(hash);
+    size_t gmask = t->capacity / HASHMAP_GROUP_WIDTH - 1;
+    size_t g = hashmap_hash_group(hash) & gmask;
+
+    for (size_t i = 0; i <= gmask; i++) {
+        const uint8_t* group = &t->ctrl[g * HASHMAP_GROUP_WIDTH];
+        for (uint32_t m = hashmap_group_match(group, tag); m; m &= m - 1) {
+            HashEntry* ent = &t->buckets[g * HASHMAP_GROUP_WIDTH + __builtin_ctz(m)];
+            if (ent->hash == hash && ent->keylen == keylen && memcmp(ent->key, key, keylen) == 0)
+                return ent;
+        }
+        if (hashmap_group_match_empty(group))
+            return NULL;
+        g = (g + i + 1) & gmask;
+    }
+    return NULL;
+}
+
+static size_t free_bucket(Table* t, uint64_t hash)
+{
+    size_t gmask = t->capacity / HASHMAP_GROUP_WIDTH - 1;
+    size_t g = hashmap_hash_group(hash) & gmask;
+
+    for (size_t i = 0; i <= gmask; i++) {
+        uint32_t m = hashmap_group_match_free(&t->ctrl[g * HASHMAP_GROUP_WIDTH]);
+        if (m)
+            return g * HASHMAP_GROUP_WIDTH + __builtin_ctz(m);
+        g = (g + i + 1) & gmask;
+    }
+    unreachable();
+}
+
+static void write_begin(Shard* sh)
+{
+    unsigned seq = atomic_load_explicit(&sh->seq, memory_order_relaxed);
+    atomic_store_explicit(&sh->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void write_end(Shard* sh)
+{
+    unsigned seq = atomic_load_explicit(&sh->seq, memory_order_relaxed);
+    atomic_store_explicit(&sh->seq, seq + 1, memory_order_release);
+}
+
+// Copies a rebuilt table of the same capacity over the shard's live one.
+static void copy_back(Shard* sh, Table* t, Table* src)
+{
+    write_begin(sh);
+    for (int i = 0; i < t->capacity; i++) {
+        if (src->ctrl[i] & HASHMAP_CTRL_EMPTY)
+            continue;
+        HashEntry* ent = &t->buckets[i];
+        store_relaxed(&ent->key, src->buckets[i].key);
+        store_relaxed(&ent->keylen, src->buckets[i].keylen);
+        store_relaxed(&ent->val, src->buckets[i].val);
+        store_relaxed(&ent->hash, src->buckets[i].hash);
+    }
+    for (int i = 0; i < t->capacity; i += 8) {
+        uint64_t w;
+        memcpy(&w, &src->ctrl[i], 8);
+        store_relaxed((uint64_t*)&t->ctrl[i], w);
+    }
+    write_end(sh);
+}
+
+// Makes room in a shard whose table has reached the high watermark. If
+// the live keys call for a bigger table, builds it and publishes it;
+// readers that already loaded the old table finish their probe on it.
+// Otherwise the table is mostly tombstones and is rebuilt in place.
+static void grow(Shard* sh)
+{
+    Table* old = atomic_load_explicit(&sh->table, memory_order_relaxed);
+    int nkeys = 0;
+    for (int i = 0; i < old->capacity; i += HASHMAP_GROUP_WIDTH)
+        nkeys += HASHMAP_GROUP_WIDTH - __builtin_popcount(hashmap_group_match_free(&old->ctrl[i]));
+
+    int cap = old->capacity;
+    while ((int64_t)nkeys * 100 / cap >= LOW_WATERMARK)
+        cap = cap * 2;
+
+    Table* t = new_table(cap);
+    for (int i = 0; i < old->capacity; i++) {
+        if (old->ctrl[i] & HASHMAP_CTRL_EMPTY)
+            continue;
+        size_t idx = free_bucket(t, old->buckets[i].hash);
+        t->buckets[idx] = old->buckets[i];
+        t->ctrl[idx] = old->ctrl[i];
+    }
+    sh->used = nkeys;
+
+    if (cap == old->capacity) {
+        copy_back(sh, old, t);
+        free_table(t);
+        return;
+    }
+    t->retired = old;
+    atomic_store_explicit(&sh->table, t, memory_order_release);
+}
+
+void* hashmap_concurrent_get(ConcurrentHashMap* map, const char* key)
+{
+    return hashmap_concurrent_get2(map, key, strlen(key));
+}
+
+void* hashmap_concurrent_get2(ConcurrentHashMap* map, const char* key, int keylen)
+{
+    uint64_t hash = hashmap_wyhash_inline(key, keylen);
+    void* val;
+    return read_entry(shard_for(map, hash), hash, key, keylen, &val) ? val : NULL;
+}
+
+void hashmap_concurrent_put(ConcurrentHashMap* map, const char* key, void* val)
+{
+    hashmap_concurrent_put2(map, key, strlen(key), val);
+}
+
+void hashmap_concurrent_put2(ConcurrentHashMap* map, const char* key, int keylen, void* val)
+{
+    uint64_t hash = hashmap_wyhash_inline(key, keylen);
+    Shard* sh = shard_for(map, hash);
+    pthread_mutex_lock(&sh->lock);
+
+    Table* t = atomic_load_explicit(&sh->table, memory_order_relaxed);
+    HashEntry* ent = find_locked(t, hash, key, keylen);
+    if (ent) {
+        // A single word store; readers see either value.
+        store_relaxed(&ent->val, val);
+        pthread_mutex_unlock(&sh->lock);
+        return;
+    }
+
+    if ((int64_t)sh->used * 100 / t->capacity >= HIGH_WATERMARK) {
+        grow(sh);
+        t = atomic_load_explicit(&sh->table, memory_order_relaxed);
+    }
+
+    size_t idx = free_bucket(t, hash);
+    if (t->ctrl[idx] == HASHMAP_CTRL_EMPTY)
+        sh->used++;
+
+    write_begin(sh);
+    ent = &t->buckets[idx];
+    store_relaxed(&ent->key, (char*)key);
+    store_relaxed(&ent->keylen, keylen);
+    store_relaxed(&ent->val, val);
+    store_relaxed(&ent->hash, hash);
+    store_relaxed(&t->ctrl[idx], hashmap_hash_tag(hash));
+    write_end(sh);
+
+    pthread_mutex_unlock(&sh->lock);
+}
+
+void hashmap_concurrent_delete(ConcurrentHashMap* map, const char* key)
+{
+    hashmap_concurrent_delete2(map, key, strlen(key));
+}
+
+void hashmap_concurrent_delete2(ConcurrentHashMap* map, const char* key, int keylen)
+{
+    uint64_t hash = hashmap_wyhash_inline(key, keylen);
+    Shard* sh = shard_for(map, hash);
+    pthread_mutex_lock(&sh->lock);
+
+    Table* t = atomic_load_explicit(&sh->table, memory_order_relaxed);
+    HashEntry* ent = find_locked(t, hash, key, keylen);
+    if (ent) {
+        size_t idx = ent - t->buckets;
+        write_begin(sh);
+        if (hashmap_group_match_empty(&t->ctrl[idx & ~(size_t)(HASHMAP_GROUP_WIDTH - 1)])) {
+            store_relaxed(&t->ctrl[idx], HASHMAP_CTRL_EMPTY);
+            sh->used--;
+        } else {
+            store_relaxed(&t->ctrl[idx], HASHMAP_CTRL_DELETED);
+        }
+        write_end(sh);
+    }
+
+    pthread_mutex_unlock(&sh->lock);
+}
@@ -0,0 +1,18 @@
+#include "hashmap_internal.h"
+
+// Hash functions that can be plugged into HashMap.hash_fn.
+
+uint64_t hashmap_fnv_hash(const char* key, int keylen)
+{
+    uint64_t hash = 0xcbf29ce484222325;
+    for (int i = 0; i < keylen; i++) {
+        hash *= 0x100000001b3;
+        hash ^= (unsigned char)key[i];
+    }
+    return hash;
+}
+
+uint64_t hashmap_wyhash(const char* key, int keylen)
+{
+    return hashmap_wyhash_inline(key, keylen);
+}
@@ -1,27 +1,370 @@
-#include "hashmap.h"
+#include "hashmap_internal.h"
 
 // This is an implementation of the open-addressing hash table.
+//
+// Buckets are laid out Swiss-table style: besides the entry array there
+// is a parallel array of one-byte control tags. A tag is either
+// HASHMAP_CTRL_EMPTY, HASHMAP_CTRL_DELETED or 7 bits of the key's hash.
+// Lookups scan the tags a group of HASHMAP_GROUP_WIDTH buckets at a time
+// and only touch an entry (and its key bytes) when its tag matches.
+//
+// With HASHMAP_ROBIN_HOOD the same arrays are probed one bucket at a time
+// instead, see the Robin Hood section below.
+//
+// Ordered maps replace the entry array with an index of offsets into a
+// dense entry array, see the ordered maps section below.
 
-// Initial hash bucket size
-#define INIT_SIZE 16
+static void alloc_buckets(HashMap* map, int cap)
+{
+    assert(cap >= HASHMAP_GROUP_WIDTH && (cap & (cap - 1)) == 0);
+    if (map->ordered) {
+        if (map->probing != HASHMAP_GROUPS || map->incremental)
+            error("hashmap: ordered maps need group probing and no incremental growth");
+        map->index = hashmap_alloc_table(map, (size_t)cap * sizeof(uint32_t));
+    } else {
+        map->buckets = hashmap_alloc_table(map, (size_t)cap * sizeof(HashEntry));
+    }
+    map->ctrl = hashmap_alloc_table(map, cap);
+    memset(map->ctrl, HASHMAP_CTRL_EMPTY, cap);
+    map->capacity = cap;
+    map->used = 0;
+}
+
+static void free_buckets(HashMap* map, HashEntry* buckets, uint8_t* ctrl, int cap)
+{
+    hashmap_free_table(map, buckets, (size_t)cap * sizeof(HashEntry));
+    hashmap_free_table(map, ctrl, cap);
+}
+
+static HashEntry* place_entry(HashMap* map, const HashEntry* src);
+static void compact_entries(HashMap* map);
+
+// Statistics. Without HASHMAP_STATS these compile to nothing.
+
+static inline void stat_probe(HashMap* map, bool hit, int steps)
+{
+#ifdef HASHMAP_STATS
+    uint64_t* hist = hit ? map->counters.hit_probes : map->counters.miss_probes;
+    hist[steps < HASHMAP_PROBE_HIST ? steps : HASHMAP_PROBE_HIST - 1]++;
+#else
+    (void)map;
+    (void)hit;
+    (void)steps;
+#endif
+}
+
+static inline uint64_t stat_clock(void)
+{
+#ifdef HASHMAP_STATS
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#else
+    return 0;
+#endif
+}
+
+// Adds the time since `start` to the time spent rehashing.
+static inline void stat_rehash_time(HashMap* map, uint64_t start)
+{
+#ifdef HASHMAP_STATS
+    map->counters.rehash_ns += stat_clock() - start;
+#else
+    (void)map;
+    (void)start;
+#endif
+}
+
+static inline void stat_rehash(HashMap* map)
+{
+#ifdef HASHMAP_STATS
+    map->counters.rehashes++;
+#else
+    (void)map;
+#endif
+}
+
+static int count_live(const uint8_t* ctrl, int capacity)
+{
+    int n = 0;
+    for (int i = 0; i < capacity; i += HASHMAP_GROUP_WIDTH)
+        n += HASHMAP_GROUP_WIDTH - __builtin_popcount(hashmap_group_match_free(&ctrl[i]));
+    return n;
+}
+
+// Watermarks in percent. A zero field selects the default, and a pair
+// outside 0 < low < high <= 95 selects both defaults: a low watermark of
+// zero or less would never let capacity_for stop doubling.
+static void watermarks(HashMap* map, int* high, int* low)
+{
+    *high = map->high_watermark ? map->high_watermark : HIGH_WATERMARK;
+    *low = map->low_watermark ? map->low_watermark : LOW_WATERMARK;
+    if (*low <= 0 || *low >= *high || *high > 95) {
+        *high = HIGH_WATERMARK;
+        *low = LOW_WATERMARK;
+    }
+}
+
+static int high_watermark(HashMap* map)
+{
+    int high, low;
+    watermarks(map, &high, &low);
+    return high;
+}
+
+static int low_watermark(HashMap* map)
+{
+    int high, low;
+    watermarks(map, &high, &low);
+    return low;
+}
+
+static bool above_high_watermark(HashMap* map)
+{
+    return (int64_t)map->used * 100 >= (int64_t)map->capacity * high_watermark(map);
+}
+
+// Returns the smallest bucket count, starting from `cap`, that holds
+// `nkeys` keys below `watermark` percent.
+static int capacity_for(int cap, int nkeys, int watermark)
+{
+    while ((int64_t)nkeys * 100 >= (int64_t)cap * watermark)
+        cap = cap * 2;
+    assert(cap > 0);
+    return cap;
+}
+
+// Returns the bucket count to use for `nkeys` keys, starting the search
+// at the current capacity.
+static int new_capacity(HashMap* map, int nkeys)
+{
+    return capacity_for(map->capacity, nkeys, low_watermark(map));
+}
 
-// Rehash if the usage exceeds 70%.
-#define HIGH_WATERMARK 70
+// Owned keys.
+//
+// With owned_keys set the map copies keys on insertion. Keys of up to
+// HASHMAP_INLINE_KEY bytes are stored in the entry itself, so comparing
+// them needs no pointer chase. Longer keys are bump-allocated from a
+// per-map arena of large chunks that is released as a whole. Deleting a
+// long key leaves its bytes behind; rehash, or the start of an
+// incremental migration, compacts the arena once such dead bytes make up
+// half of it.
 
-// We'll keep the usage below 50% after rehashing.
-#define LOW_WATERMARK 50
+#define ARENA_CHUNK (64 * 1024)
 
-// Represents a deleted hash entry
-#define TOMBSTONE ((void*)-1)
+typedef struct ArenaChunk ArenaChunk;
+struct ArenaChunk {
+    ArenaChunk* next;
+    size_t used;
+    size_t cap;
+    char data[];
+};
 
-static uint64_t fnv_hash(const char* s, int len)
+struct HashMapArena {
+    ArenaChunk* chunks;
+    size_t bytes; // bytes handed out
+    size_t dead; // bytes of deleted keys
+};
+
+static char* arena_alloc(HashMapArena* arena, size_t len)
+{
+    ArenaChunk* c = arena->chunks;
+    if (!c || c->cap - c->used < len) {
+        size_t cap = len > ARENA_CHUNK ? len : ARENA_CHUNK;
+        c = malloc(sizeof(ArenaChunk) + cap);
+        c->used = 0;
+        c->cap = cap;
+        c->next = arena->chunks;
+        arena->chunks = c;
+    }
+    char* p = c->data + c->used;
+    c->used += len;
+    arena->bytes += len;
+    return p;
+}
+
+static void arena_free(HashMapArena* arena)
 {
-    uint64_t hash = 0xcbf29ce484222325;
-    for (int i = 0; i < len; i++) {
-        hash *= 0x100000001b3;
-        hash ^= (unsigned char)s[i];
+    for (ArenaChunk* c = arena->chunks; c;) {
+        ArenaChunk* next = c->next;
+        free(c);
+        c = next;
     }
-    return hash;
+    free(arena);
+}
+
+static char* arena_copy(HashMap* map, const char* key, int keylen)
+{
+    if (!map->arena)
+        map->arena = calloc(1, sizeof(HashMapArena));
+    return memcpy(arena_alloc(map->arena, keylen), key, keylen);
+}
+
+// Moves the live long keys of the current table into a fresh arena.
+static void compact_arena(HashMap* map)
+{
+    HashMapArena* old = map->arena;
+    map->arena = calloc(1, sizeof(HashMapArena));
+    for (int i = 0; i < map->capacity; i++) {
+        if (map->ctrl[i] & HASHMAP_CTRL_EMPTY)
+            continue;
+        HashEntry* ent = bucket_entry(map, map->buckets, i);
+        if (ent->keylen > HASHMAP_INLINE_KEY)
+            ent->key = memcpy(arena_alloc(map->arena, ent->keylen), ent->key, ent->keylen);
+    }
+    arena_free(old);
+}
+
+// Bloom pre-filter.
+//
+// With bloom_bits set the map keeps a blocked Bloom filter over its keys:
+// every key sets bloom_k(bits) bits in one 64-byte block, so checking a
+// key costs one cache line, and most absent keys are turned away without
+// probing. The filter is derived from the stored hash, sized for the
+// table at its high watermark and rebuilt whenever the table is
+// reallocated. Deleted keys leave their bits set; once they amount to
+// half of the keys added, and enough of them have accumulated to pay for
+// a pass over the table, the filter is rebuilt as well.
+
+typedef struct {
+    uint64_t words[8];
+} __attribute__((aligned(64))) BloomBlock;
+
+struct HashMapBloom {
+    BloomBlock* blocks;
+    size_t mask; // block count - 1
+    int k; // bits set per key
+    int keys; // keys added since the last rebuild
+    int stale; // of which deleted
+};
+
+static inline uint64_t bloom_hash(uint64_t hash)
+{
+    return hashmap_wy_mix(hash ^ hashmap_wy_secret[2], hashmap_wy_secret[3]);
+}
+
+static inline BloomBlock* bloom_block(HashMapBloom* bloom, uint64_t h)
+{
+    return &bloom->blocks[(h >> 32) & bloom->mask];
+}
+
+// Bit positions within a block come from double hashing the low half.
+static void bloom_add(HashMapBloom* bloom, uint64_t hash)
+{
+    uint64_t h = bloom_hash(hash);
+    BloomBlock* b = bloom_block(bloom, h);
+    uint32_t h1 = h, h2 = (h1 >> 17 | h1 << 15) | 1;
+    for (int i = 0; i < bloom->k; i++, h1 += h2)
+        b->words[(h1 >> 6) & 7] |= 1ull << (h1 & 63);
+    bloom->keys++;
+}
+
+static bool bloom_may_contain(HashMap* map, uint64_t hash)
+{
+    HashMapBloom* bloom = map->bloom;
+    if (!bloom)
+        return true;
+    uint64_t h = bloom_hash(hash);
+    BloomBlock* b = bloom_block(bloom, h);
+    uint32_t h1 = h, h2 = (h1 >> 17 | h1 << 15) | 1;
+    bool found = true;
+    for (int i = 0; i < bloom->k && found; i++, h1 += h2)
+        found = b->words[(h1 >> 6) & 7] & (1ull << (h1 & 63));
+#ifdef HASHMAP_STATS
+    map->counters.bloom_queries++;
+    map->counters.bloom_rejects += !found;
+#endif
+    return found;
+}
+
+static void bloom_free(HashMap* map)
+{
+    if (map->bloom) {
+        free(map->bloom->blocks);
+        free(map->bloom);
+        map->bloom = NULL;
+    }
+}
+
+static void bloom_add_table(HashMap* map, const uint8_t* ctrl, HashEntry* buckets, int capacity)
+{
+    for (int i = 0; i < capacity; i++)
+        if (!(ctrl[i] & HASHMAP_CTRL_EMPTY))
+            bloom_add(map->bloom, bucket_entry(map, buckets, i)->hash);
+}
+
+// Sizes the filter for the current table and adds every key in it and in
+// the old table. A no-op unless bloom_bits is set.
+static void bloom_rebuild(HashMap* map)
+{
+    if (!map->bloom_bits)
+        return;
+    if (map->bloom_bits < 0 || map->bloom_bits > 64)
+        error("hashmap: bad bloom_bits %d", map->bloom_bits);
+
+    HashMapBloom* bloom = map->bloom;
+    if (!bloom)
+        bloom = map->bloom = calloc(1, sizeof(HashMapBloom));
+
+    int64_t bits = (int64_t)map->capacity * high_watermark(map) / 100 * map->bloom_bits;
+    size_t nblocks = 1;
+    while ((int64_t)nblocks * 512 < bits)
+        nblocks *= 2;
+    if (!bloom->blocks || bloom->mask != nblocks - 1) {
+        free(bloom->blocks);
+        bloom->blocks = aligned_alloc(sizeof(BloomBlock), nblocks * sizeof(BloomBlock));
+        bloom->mask = nblocks - 1;
+    }
+    memset(bloom->blocks, 0, nblocks * sizeof(BloomBlock));
+
+    // About ln 2 bits per key bit, fewer for the blocked layout.
+    bloom->k = map->bloom_bits * 2 / 3;
+    if (bloom->k < 1)
+        bloom->k = 1;
+    if (bloom->k > 16)
+        bloom->k = 16;
+    bloom->keys = 0;
+    bloom->stale = 0;
+
+    bloom_add_table(map, map->ctrl, map->buckets, map->capacity);
+    if (map->old_buckets)
+        bloom_add_table(map, map->old_ctrl, map->old_buckets, map->old_capacity);
+}
+
+// Moves all entries into a new bucket array of `cap` buckets, dropping
+// tombstones. Ordered maps keep their entries where they are, minus the
+// holes, and only rebuild the index.
+static void resize(HashMap* map, int cap)
+{
+    uint64_t start = stat_clock();
+
+    // Create a new bucket array and copy all key-values.
+    HashEntry* buckets = map->buckets;
+    uint32_t* index = map->index;
+    uint8_t* ctrl = map->ctrl;
+    int oldcap = map->capacity;
+    alloc_buckets(map, cap);
+
+    // Entries carry their hash, so moving them never reads the key bytes.
+    if (map->ordered) {
+        compact_entries(map);
+    } else {
+        for (int i = 0; i < oldcap; i++)
+            if (!(ctrl[i] & HASHMAP_CTRL_EMPTY))
+                place_entry(map, &buckets[i]);
+    }
+
+    assert(map->used == count_live(ctrl, oldcap));
+    free_buckets(map, buckets, ctrl, oldcap);
+    hashmap_free_table(map, index, (size_t)oldcap * sizeof(uint32_t));
+
+    if (map->arena && map->arena->dead * 2 >= map->arena->bytes)
+        compact_arena(map);
+    bloom_rebuild(map);
+
+    stat_rehash(map);
+    stat_rehash_time(map, start);
 }
 
 // Make room for new entries in a given hashmap by removing
@@ -29,86 +372,470 @@ static uint64_t fnv_hash(const char* s, int len)
 static void rehash(HashMap* map)
 {
     // Compute the size of the new hashmap.
-    int nkeys = 0;
-    for (int i = 0; i < map->capacity; i++)
-        if (map->buckets[i].key && map->buckets[i].key != TOMBSTONE)
-            nkeys++;
+    int nkeys = count_live(map->ctrl, map->capacity);
+    resize(map, new_capacity(map, nkeys));
+}
 
-    int cap = map->capacity;
-    while ((nkeys * 100) / cap >= LOW_WATERMARK)
-        cap = cap * 2;
-    assert(cap > 0);
+// Incremental rehashing.
+//
+// Instead of moving every entry at once, growing turns the current bucket
+// array into the "old" table and starts over with an empty one. Every
+// put, get and delete then moves the next MIGRATE_STEP old buckets, and
+// lookups consult both tables until the old one is drained. A key is in
+// exactly one of the two tables at any time: puts update keys found in
+// the old table in place and only insert absent keys into the new one.
 
-    // Create a new hashmap and copy all key-values.
-    HashMap map2 = {};
-    map2.buckets = calloc(cap, sizeof(HashEntry));
-    map2.capacity = cap;
+// Number of old buckets moved by each operation while migrating.
+#define MIGRATE_STEP 64
 
-    for (int i = 0; i < map->capacity; i++) {
-        HashEntry* ent = &map->buckets[i];
-        if (ent->key && ent->key != TOMBSTONE)
-            hashmap_put2(&map2, ent->key, ent->keylen, ent->val);
+static void migrate(HashMap* map, int nbuckets)
+{
+    uint64_t start = stat_clock();
+    int end = map->migrate_pos + nbuckets;
+    if (end > map->old_capacity)
+        end = map->old_capacity;
+
+    // Migrated buckets are marked deleted so that probe sequences
+    // running through them in the old table stay intact.
+    for (int i = map->migrate_pos; i < end; i++) {
+        if (map->old_ctrl[i] & HASHMAP_CTRL_EMPTY)
+            continue;
+        place_entry(map, &map->old_buckets[i]);
+        map->old_ctrl[i] = HASHMAP_CTRL_DELETED;
     }
+    map->migrate_pos = end;
 
-    assert(map2.used == nkeys);
-    *map = map2;
+    if (end == map->old_capacity) {
+        free_buckets(map, map->old_buckets, map->old_ctrl, map->old_capacity);
+        map->old_buckets = NULL;
+        map->old_ctrl = NULL;
+        map->old_capacity = 0;
+    }
+    stat_rehash_time(map, start);
 }
 
-static inline bool match(HashEntry* ent, const char* key, int keylen)
+void hashmap_finish_migration(HashMap* map)
 {
-    return ent->key && ent->key != TOMBSTONE && ent->keylen == keylen && memcmp(ent->key, key, keylen) == 0;
+    if (map->old_buckets)
+        migrate(map, map->old_capacity);
 }
 
-static HashEntry* get_entry(HashMap* map, const char* key, int keylen)
+static void start_migration(HashMap* map)
 {
-    if (!map->buckets)
-        return NULL;
+    uint64_t start = stat_clock();
+    int nkeys = count_live(map->ctrl, map->capacity);
+    int cap = new_capacity(map, nkeys);
 
-    uint64_t hash = fnv_hash(key, keylen);
+    // All keys are still in the current table, the only one that
+    // compact_arena walks.
+    if (map->arena && map->arena->dead * 2 >= map->arena->bytes)
+        compact_arena(map);
 
-    for (int i = 0; i < map->capacity; i++) {
-        HashEntry* ent = &map->buckets[(hash + i) % map->capacity];
-        if (match(ent, key, keylen))
+    map->old_buckets = map->buckets;
+    map->old_ctrl = map->ctrl;
+    map->old_capacity = map->capacity;
+    map->migrate_pos = 0;
+    alloc_buckets(map, cap);
+    bloom_rebuild(map);
+
+    stat_rehash(map);
+    stat_rehash_time(map, start);
+}
+
+// Called when the bucket array has reached the high watermark.
+static void grow(HashMap* map)
+{
+    if (!map->incremental) {
+        rehash(map);
+        return;
+    }
+
+    // The new table filled up before the previous migration finished.
+    // Finish it first; that may have only moved keys out of the way.
+    if (map->old_buckets) {
+        hashmap_finish_migration(map);
+        if (!above_high_watermark(map))
+            return;
+    }
+    start_migration(map);
+}
+
+// The stored hash is compared first so that tag collisions rarely reach
+// memcmp.
+static inline bool match(HashMap* map, HashEntry* ent, uint64_t hash, const char* key, int keylen)
+{
+    return ent->hash == hash && ent->keylen == keylen && memcmp(entry_key(map, ent), key, keylen) == 0;
+}
+
+// Groups are visited in triangular order (g, g+1, g+3, g+6, ...), which
+// covers every group exactly once because the group count is a power of two.
+static HashEntry* probe_groups(HashMap* map, HashEntry* buckets, const uint8_t* ctrl, int capacity,
+    uint64_t hash, const char* key, int keylen, int* steps)
+{
+    uint8_t tag = hashmap_hash_tag(hash);
+    size_t gmask = capacity / HASHMAP_GROUP_WIDTH - 1;
+    size_t g = hashmap_hash_group(hash) & gmask;
+
+    for (size_t i = 0; i <= gmask; i++) {
+        const uint8_t* group = &ctrl[g * HASHMAP_GROUP_WIDTH];
+        (*steps)++;
+        for (uint32_t m = hashmap_group_match(group, tag); m; m &= m - 1) {
+            HashEntry* ent = bucket_entry(map, buckets, g * HASHMAP_GROUP_WIDTH + __builtin_ctz(m));
+            if (match(map, ent, hash, key, keylen))
+                return ent;
+        }
+        if (hashmap_group_match_empty(group))
+            return NULL;
+        g = (g + i + 1) & gmask;
+    }
+    return NULL;
+}
+
+// Robin Hood probing.
+//
+// Buckets are probed linearly from the key's home bucket. On insertion an
+// entry that is further from its home than the resident of a bucket takes
+// the bucket, and the resident moves on. Entries along a probe sequence
+// are therefore ordered by distance from home, which lets a lookup stop as
+// soon as it meets an entry closer to home than itself, and lets a delete
+// shift the following entries back by one instead of leaving a tombstone.
+// The control bytes still hold tags, so mismatching buckets are mostly
+// skipped without reading the entry.
+//
+// The current table never has HASHMAP_CTRL_DELETED buckets. An old table
+// that is being migrated does, but its entries are left in place, so
+// distances computed from their stored hashes stay valid.
+
+static inline size_t home_bucket(uint64_t hash, size_t mask)
+{
+    return hashmap_hash_group(hash) & mask;
+}
+
+static inline size_t distance(size_t idx, uint64_t hash, size_t mask)
+{
+    return (idx - home_bucket(hash, mask)) & mask;
+}
+
+static HashEntry* probe_robin_hood(HashMap* map, HashEntry* buckets, const uint8_t* ctrl, int capacity,
+    uint64_t hash, const char* key, int keylen, int* steps)
+{
+    uint8_t tag = hashmap_hash_tag(hash);
+    size_t mask = capacity - 1;
+    size_t idx = home_bucket(hash, mask);
+
+    for (size_t dist = 0; dist <= mask; dist++, idx = (idx + 1) & mask) {
+        (*steps)++;
+        if (ctrl[idx] == HASHMAP_CTRL_EMPTY)
+            return NULL;
+        HashEntry* ent = &buckets[idx];
+        if (ctrl[idx] == tag && match(map, ent, hash, key, keylen))
             return ent;
-        if (ent->key == NULL)
+        if (distance(idx, ent->hash, mask) < dist)
             return NULL;
     }
+    return NULL;
+}
+
+// Inserts an entry whose key is not in the map and returns the bucket it
+// ended up in.
+static HashEntry* insert_robin_hood(HashMap* map, const HashEntry* src)
+{
+    size_t mask = map->capacity - 1;
+    size_t idx = home_bucket(src->hash, mask);
+    HashEntry cur = *src;
+    HashEntry* placed = NULL;
+
+    for (size_t dist = 0; dist <= mask; dist++, idx = (idx + 1) & mask) {
+        if (map->ctrl[idx] == HASHMAP_CTRL_EMPTY) {
+            map->buckets[idx] = cur;
+            map->ctrl[idx] = hashmap_hash_tag(cur.hash);
+            map->used++;
+            return placed ? placed : &map->buckets[idx];
+        }
+
+        size_t d = distance(idx, map->buckets[idx].hash, mask);
+        if (d < dist) {
+            HashEntry tmp = map->buckets[idx];
+            map->buckets[idx] = cur;
+            map->ctrl[idx] = hashmap_hash_tag(cur.hash);
+            cur = tmp;
+            dist = d;
+            if (!placed)
+                placed = &map->buckets[idx];
+        }
+    }
     unreachable();
 }
 
-static HashEntry* get_or_insert_entry(HashMap* map, const char* key, int keylen)
+// Backward-shift deletion: entries after the removed one move back by a
+// bucket until one is already at its home or the run ends.
+static void erase_robin_hood(HashMap* map, size_t idx)
 {
-    if (!map->buckets) {
-        map->buckets = calloc(INIT_SIZE, sizeof(HashEntry));
-        map->capacity = INIT_SIZE;
-    } else if ((map->used * 100) / map->capacity >= HIGH_WATERMARK) {
-        rehash(map);
+    size_t mask = map->capacity - 1;
+    size_t next = (idx + 1) & mask;
+
+    while (map->ctrl[next] != HASHMAP_CTRL_EMPTY && distance(next, map->buckets[next].hash, mask) > 0) {
+        map->buckets[idx] = map->buckets[next];
+        map->ctrl[idx] = map->ctrl[next];
+        idx = next;
+        next = (next + 1) & mask;
     }
+    map->ctrl[idx] = HASHMAP_CTRL_EMPTY;
+    map->used--;
+}
 
-    uint64_t hash = fnv_hash(key, keylen);
+// `steps` is increased by the number of groups (Robin Hood: buckets)
+// visited.
+static HashEntry* probe(HashMap* map, HashEntry* buckets, const uint8_t* ctrl, int capacity,
+    uint64_t hash, const char* key, int keylen, int* steps)
+{
+    if (map->probing == HASHMAP_ROBIN_HOOD)
+        return probe_robin_hood(map, buckets, ctrl, capacity, hash, key, keylen, steps);
+    return probe_groups(map, buckets, ctrl, capacity, hash, key, keylen, steps);
+}
 
-    for (int i = 0; i < map->capacity; i++) {
-        HashEntry* ent = &map->buckets[(hash + i) % map->capacity];
+static HashEntry* find_entry(HashMap* map, uint64_t hash, const char* key, int keylen)
+{
+    int steps = 0;
+    HashEntry* ent = probe(map, map->buckets, map->ctrl, map->capacity, hash, key, keylen, &steps);
+    if (!ent && map->old_buckets)
+        ent = probe(map, map->old_buckets, map->old_ctrl, map->old_capacity, hash, key, keylen, &steps);
+    stat_probe(map, ent != NULL, steps);
+    return ent;
+}
 
-        if (match(ent, key, keylen))
-            return ent;
+// find_entry behind the Bloom filter, if the map has one.
+static HashEntry* find_filtered(HashMap* map, uint64_t hash, const char* key, int keylen)
+{
+    if (!bloom_may_contain(map, hash))
+        return NULL;
+    HashEntry* ent = find_entry(map, hash, key, keylen);
+#ifdef HASHMAP_STATS
+    if (!ent && map->bloom)
+        map->counters.bloom_false_positives++;
+#endif
+    return ent;
+}
 
-        if (ent->key == TOMBSTONE) {
-            ent->key = (char*)key; // Cast to char* to match original logic
-            ent->keylen = keylen;
-            return ent;
+static HashEntry* get_entry(HashMap* map, const char* key, int keylen)
+{
+    if (!map->ctrl)
+        return NULL;
+    if (map->old_buckets)
+        migrate(map, MIGRATE_STEP);
+    return find_filtered(map, hash_key(map, key, keylen), key, keylen);
+}
+
+// Takes the first empty or deleted bucket on the probe sequence of `hash`
+// and tags it as used. The caller fills in the entry, or for ordered maps
+// the index.
+static size_t claim_bucket(HashMap* map, uint64_t hash)
+{
+    size_t gmask = map->capacity / HASHMAP_GROUP_WIDTH - 1;
+    size_t g = hashmap_hash_group(hash) & gmask;
+
+    for (size_t i = 0; i <= gmask; i++) {
+        uint32_t m = hashmap_group_match_free(&map->ctrl[g * HASHMAP_GROUP_WIDTH]);
+        if (m) {
+            size_t idx = g * HASHMAP_GROUP_WIDTH + __builtin_ctz(m);
+            if (map->ctrl[idx] == HASHMAP_CTRL_EMPTY)
+                map->used++;
+            map->ctrl[idx] = hashmap_hash_tag(hash);
+            return idx;
         }
+        g = (g + i + 1) & gmask;
+    }
+    unreachable();
+}
 
-        if (ent->key == NULL) {
-            ent->key = (char*)key; // Cast to char* to match original logic
-            ent->keylen = keylen;
-            map->used++;
-            return ent;
+// Untags bucket `idx` of the current table after its key was deleted.
+static void release_bucket(HashMap* map, size_t idx)
+{
+    // A group that still has an empty bucket has never been probed past,
+    // so the bucket can go straight back to empty instead of becoming a
+    // tombstone.
+    if (hashmap_group_match_empty(&map->ctrl[idx & ~(size_t)(HASHMAP_GROUP_WIDTH - 1)])) {
+        map->ctrl[idx] = HASHMAP_CTRL_EMPTY;
+        map->used--;
+    } else {
+        map->ctrl[idx] = HASHMAP_CTRL_DELETED;
+    }
+}
+
+// Ordered maps.
+//
+// Entries are appended to `entries` in insertion order, and the bucket
+// a key's probe ends at holds the entry's offset in `index` instead of
+// the entry itself: with a 4-byte offset and the control byte, a bucket
+// costs 5 bytes instead of 41, so the index can be kept sparse while the
+// entries stay dense. Probing is unchanged; matching tags are resolved
+// through the index.
+//
+// A deleted entry becomes a hole (keylen -1) that iteration skips. Holes
+// are squeezed out when the table is rehashed, or when the entry array
+// is full and at least a quarter of it is holes.
+
+static void set_entries_capacity(HashMap* map, int n)
+{
+    map->entries = realloc(map->entries, (size_t)n * sizeof(HashEntry));
+    if (!map->entries)
+        error("hashmap: out of memory");
+    map->entries_capacity = n;
+}
+
+// Moves the live entries to the front, keeping their order, and indexes
+// them into the current table, which must be empty.
+static void compact_entries(HashMap* map)
+{
+    int n = 0;
+    for (int i = 0; i < map->nentries; i++) {
+        if (map->entries[i].keylen < 0)
+            continue;
+        map->entries[n] = map->entries[i];
+        map->index[claim_bucket(map, map->entries[n].hash)] = n;
+        n++;
+    }
+    map->nentries = n;
+    map->holes = 0;
+}
+
+// Makes room for one more entry, either by squeezing out holes, which
+// rebuilds the index, the Bloom filter and possibly the arena, or by
+// growing the entry array.
+static void reserve_entry(HashMap* map)
+{
+    if (map->nentries < map->entries_capacity)
+        return;
+    if (map->holes * 4 >= map->nentries && map->holes > 0)
+        resize(map, map->capacity);
+    else
+        set_entries_capacity(map, map->entries_capacity ? map->entries_capacity * 2 : INIT_SIZE);
+}
+
+static HashEntry* append_entry(HashMap* map, const HashEntry* src)
+{
+    reserve_entry(map);
+    int n = map->nentries++;
+    map->entries[n] = *src;
+    map->index[claim_bucket(map, src->hash)] = n;
+    return &map->entries[n];
+}
+
+// Returns the bucket whose index points at entry `n`.
+static size_t index_bucket(HashMap* map, uint32_t n)
+{
+    uint64_t hash = map->entries[n].hash;
+    size_t gmask = map->capacity / HASHMAP_GROUP_WIDTH - 1;
+    size_t g = hashmap_hash_group(hash) & gmask;
+
+    for (size_t i = 0; i <= gmask; i++) {
+        for (uint32_t m = hashmap_group_match(&map->ctrl[g * HASHMAP_GROUP_WIDTH], hashmap_hash_tag(hash)); m; m &= m - 1) {
+            size_t idx = g * HASHMAP_GROUP_WIDTH + __builtin_ctz(m);
+            if (map->index[idx] == n)
+                return idx;
         }
+        g = (g + i + 1) & gmask;
     }
     unreachable();
 }
 
+static void erase_ordered(HashMap* map, HashEntry* ent)
+{
+    int n = ent - map->entries;
+    release_bucket(map, index_bucket(map, n));
+    ent->keylen = -1;
+    if (n == map->nentries - 1)
+        map->nentries--;
+    else
+        map->holes++;
+}
+
+// Copies an entry whose key is not in the map into the current table.
+static HashEntry* place_entry(HashMap* map, const HashEntry* src)
+{
+    if (map->probing == HASHMAP_ROBIN_HOOD)
+        return insert_robin_hood(map, src);
+    if (map->ordered)
+        return append_entry(map, src);
+    HashEntry* ent = &map->buckets[claim_bucket(map, src->hash)];
+    *ent = *src;
+    return ent;
+}
+
+// Inserts a key that is known not to be in the map.
+static HashEntry* insert_entry(HashMap* map, uint64_t hash, const char* key, int keylen)
+{
+    // Compaction only keeps the filter bits and arena copies of keys
+    // already in the table, so it must not happen in between.
+    if (map->ordered)
+        reserve_entry(map);
+
+    HashEntry ent = {};
+    ent.keylen = keylen;
+    ent.hash = hash;
+    if (!map->owned_keys)
+        ent.key = (char*)key; // Cast to char* to match original logic
+    else if (keylen <= HASHMAP_INLINE_KEY)
+        memcpy(ent.inline_key, key, keylen);
+    else
+        ent.key = arena_copy(map, key, keylen);
+    if (map->bloom)
+        bloom_add(map->bloom, hash);
+    return place_entry(map, &ent);
+}
+
+static void check_writable(HashMap* map)
+{
+    if (map->image)
+        error("hashmap: cannot modify a memory-mapped map");
+}
+
+static HashEntry* get_or_insert_entry(HashMap* map, const char* key, int keylen, bool* inserted)
+{
+    check_writable(map);
+    if (!map->ctrl) {
+        alloc_buckets(map, INIT_SIZE);
+        bloom_rebuild(map);
+    } else if (above_high_watermark(map)) {
+        grow(map);
+    }
+    if (map->old_buckets)
+        migrate(map, MIGRATE_STEP);
+
+    uint64_t hash = hash_key(map, key, keylen);
+    HashEntry* ent = find_filtered(map, hash, key, keylen);
+    *inserted = !ent;
+    if (ent)
+        return ent;
+    return insert_entry(map, hash, key, keylen);
+}
+
+static void erase_entry(HashMap* map, HashEntry* ent)
+{
+    if (map->owned_keys && ent->keylen > HASHMAP_INLINE_KEY)
+        map->arena->dead += ent->keylen;
+
+    // The old table is only read until it is drained, a tombstone is all
+    // it needs.
+    if (map->old_buckets && ent >= map->old_buckets && ent < map->old_buckets + map->old_capacity) {
+        map->old_ctrl[ent - map->old_buckets] = HASHMAP_CTRL_DELETED;
+        return;
+    }
+
+    if (map->ordered) {
+        erase_ordered(map, ent);
+        return;
+    }
+
+    size_t idx = ent - map->buckets;
+    if (map->probing == HASHMAP_ROBIN_HOOD) {
+        erase_robin_hood(map, idx);
+        return;
+    }
+
+    release_bucket(map, idx);
+}
+
 void* hashmap_get(HashMap* map, const char* key)
 {
     return hashmap_get2(map, key, strlen(key));
@@ -120,6 +847,61 @@ void* hashmap_get2(HashMap* map, const char* key, int keylen)
     return ent ? ent->val : NULL;
 }
 
+// Number of keys whose probes are overlapped by hashmap_get_batch.
+#define BATCH_WINDOW 32
+
+// Looks up n keys at once. The keys of a window are hashed first and the
+// control group of each key is prefetched; then the groups are scanned
+// and the first candidate entry of each key is prefetched; only then are
+// the keys resolved. The cache misses of a whole window are in flight at
+// the same time instead of one after another.
+void hashmap_get_batch(HashMap* map, const char* const* keys, const int* lens, int n, void** vals)
+{
+    if (!map->ctrl) {
+        for (int i = 0; i < n; i++)
+            vals[i] = NULL;
+        return;
+    }
+
+    uint64_t hashes[BATCH_WINDOW];
+    size_t gmask = map->capacity / HASHMAP_GROUP_WIDTH - 1;
+
+    for (int base = 0; base < n; base += BATCH_WINDOW) {
+        int len = n - base < BATCH_WINDOW ? n - base : BATCH_WINDOW;
+        if (map->old_buckets)
+            migrate(map, MIGRATE_STEP);
+
+        if (map->probing == HASHMAP_ROBIN_HOOD) {
+            // Probes are short and linear, the home bucket is what misses.
+            for (int i = 0; i < len; i++) {
+                hashes[i] = hash_key(map, keys[base + i], lens[base + i]);
+                size_t idx = home_bucket(hashes[i], map->capacity - 1);
+                __builtin_prefetch(&map->ctrl[idx]);
+                __builtin_prefetch(&map->buckets[idx]);
+            }
+        } else {
+            for (int i = 0; i < len; i++) {
+                hashes[i] = hash_key(map, keys[base + i], lens[base + i]);
+                __builtin_prefetch(&map->ctrl[(hashmap_hash_group(hashes[i]) & gmask) * HASHMAP_GROUP_WIDTH]);
+                if (map->bloom)
+                    __builtin_prefetch(bloom_block(map->bloom, bloom_hash(hashes[i])));
+            }
+
+            for (int i = 0; i < len; i++) {
+                size_t g = hashmap_hash_group(hashes[i]) & gmask;
+                uint32_t m = hashmap_group_match(&map->ctrl[g * HASHMAP_GROUP_WIDTH], hashmap_hash_tag(hashes[i]));
+                if (m)
+                    __builtin_prefetch(bucket_entry(map, map->buckets, g * HASHMAP_GROUP_WIDTH + __builtin_ctz(m)));
+            }
+        }
+
+        for (int i = 0; i < len; i++) {
+            HashEntry* ent = find_filtered(map, hashes[i], keys[base + i], lens[base + i]);
+            vals[base + i] = ent ? ent->val : NULL;
+        }
+    }
+}
+
 void hashmap_put(HashMap* map, const char* key, void* val)
 {
     hashmap_put2(map, key, strlen(key), val);
@@ -127,10 +909,21 @@ void hashmap_put(HashMap* map, const char* key, void* val)
 
 void hashmap_put2(HashMap* map, const char* key, int keylen, void* val)
 {
-    HashEntry* ent = get_or_insert_entry(map, key, keylen);
+    bool inserted;
+    HashEntry* ent = get_or_insert_entry(map, key, keylen, &inserted);
     ent->val = val;
 }
 
+// Looks up a key, inserting it with a NULL value if it is absent, and
+// returns its value slot so that read-modify-write updates hash and
+// probe only once.
+void** hashmap_slot(HashMap* map, const char* key, int keylen, bool* inserted)
+{
+    bool dummy;
+    HashEntry* ent = get_or_insert_entry(map, key, keylen, inserted ? inserted : &dummy);
+    return &ent->val;
+}
+
 void hashmap_delete(HashMap* map, const char* key)
 {
     hashmap_delete2(map, key, strlen(key));
@@ -138,9 +931,166 @@ void hashmap_delete(HashMap* map, const char* key)
 
 void hashmap_delete2(HashMap* map, const char* key, int keylen)
 {
+    check_writable(map);
     HashEntry* ent = get_entry(map, key, keylen);
-    if (ent)
-        ent->key = TOMBSTONE;
+    if (!ent)
+        return;
+    erase_entry(map, ent);
+    if (map->bloom && ++map->bloom->stale * 2 > map->bloom->keys && map->bloom->stale >= map->capacity / 8)
+        bloom_rebuild(map);
+}
+
+// Sizes the table so that `n` keys fit without a rehash. Bulk loads
+// call this once up front instead of growing through every power of two.
+void hashmap_reserve(HashMap* map, int n)
+{
+    check_writable(map);
+    hashmap_finish_migration(map);
+
+    int cap = capacity_for(INIT_SIZE, n, high_watermark(map));
+    if (!map->ctrl) {
+        alloc_buckets(map, cap);
+        bloom_rebuild(map);
+    } else if (cap > map->capacity) {
+        resize(map, cap);
+    }
+    if (map->ordered && map->entries_capacity < map->holes + n)
+        set_entries_capacity(map, map->holes + n);
+}
+
+// Gives memory back after mass deletes: the table shrinks to the
+// smallest size that keeps the live keys below the low watermark, and
+// tombstones, holes and dead owned-key bytes are dropped on the way.
+void hashmap_shrink_to_fit(HashMap* map)
+{
+    if (!map->ctrl)
+        return;
+    check_writable(map);
+    hashmap_finish_migration(map);
+
+    int nkeys = count_live(map->ctrl, map->capacity);
+    if (nkeys == 0) {
+        hashmap_free(map);
+        return;
+    }
+
+    int cap = capacity_for(INIT_SIZE, nkeys, low_watermark(map));
+    if (cap < map->capacity || map->used > nkeys || map->holes)
+        resize(map, cap < map->capacity ? cap : map->capacity);
+    if (map->ordered && map->entries_capacity > map->nentries)
+        set_entries_capacity(map, map->nentries);
+    if (map->arena && map->arena->dead)
+        compact_arena(map);
+}
+
+#ifdef HASHMAP_STATS
+void hashmap_stats(HashMap* map, HashMapStats* stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->capacity = map->capacity;
+
+    for (int i = 0; i < map->capacity; i++) {
+        if (map->ctrl[i] == HASHMAP_CTRL_DELETED)
+            stats->tombstones++;
+        else if (map->ctrl[i] != HASHMAP_CTRL_EMPTY)
+            stats->live++;
+    }
+    for (int i = map->migrate_pos; i < map->old_capacity; i++)
+        if (!(map->old_ctrl[i] & HASHMAP_CTRL_EMPTY))
+            stats->live++;
+    stats->load_factor = map->capacity ? (double)stats->live / map->capacity : 0;
+
+    memcpy(stats->hit_probes, map->counters.hit_probes, sizeof(stats->hit_probes));
+    memcpy(stats->miss_probes, map->counters.miss_probes, sizeof(stats->miss_probes));
+    stats->rehashes = map->counters.rehashes;
+    stats->rehash_seconds = map->counters.rehash_ns / 1e9;
+    stats->bloom_queries = map->counters.bloom_queries;
+    stats->bloom_rejects = map->counters.bloom_rejects;
+    stats->bloom_false_positives = map->counters.bloom_false_positives;
+
+    size_t bucket = (map->ordered ? sizeof(uint32_t) : sizeof(HashEntry)) + 1;
+    stats->bytes_allocated = (size_t)(map->capacity + map->old_capacity) * bucket;
+    stats->bytes_allocated += (size_t)map->entries_capacity * sizeof(HashEntry);
+    if (map->arena)
+        for (ArenaChunk* c = map->arena->chunks; c; c = c->next)
+            stats->bytes_allocated += sizeof(ArenaChunk) + c->cap;
+    if (map->bloom)
+        stats->bytes_allocated += (map->bloom->mask + 1) * sizeof(BloomBlock);
+}
+#endif
+
+// Releases the memory of the map, including owned keys. The map is left
+// empty with its settings intact and can be used again.
+void hashmap_free(HashMap* map)
+{
+    if (map->image) {
+        hashmap_close_image(map->image);
+        map->image = NULL;
+        map->buckets = NULL;
+        map->ctrl = NULL;
+    }
+    free_buckets(map, map->buckets, map->ctrl, map->capacity);
+    free_buckets(map, map->old_buckets, map->old_ctrl, map->old_capacity);
+    hashmap_free_table(map, map->index, (size_t)map->capacity * sizeof(uint32_t));
+    free(map->entries);
+    if (map->arena)
+        arena_free(map->arena);
+    bloom_free(map);
+
+    map->buckets = NULL;
+    map->ctrl = NULL;
+    map->capacity = 0;
+    map->used = 0;
+    map->old_buckets = NULL;
+    map->old_ctrl = NULL;
+    map->old_capacity = 0;
+    map->migrate_pos = 0;
+    map->index = NULL;
+    map->entries = NULL;
+    map->nentries = 0;
+    map->entries_capacity = 0;
+    map->holes = 0;
+    map->arena = NULL;
+}
+
+void hashmap_iter_init(HashMap* map, HashMapIter* it)
+{
+    it->map = map;
+    it->pos = 0;
+}
+
+// Returns the live entry at iterator position `pos`, or NULL. Positions
+// run over the entries of ordered maps, and otherwise over the buckets of
+// the current table followed by those of the old one, whose migrated
+// buckets are marked deleted.
+static HashEntry* iter_entry(HashMap* map, int pos)
+{
+    if (map->ordered)
+        return map->entries[pos].keylen < 0 ? NULL : &map->entries[pos];
+    if (pos < map->capacity)
+        return map->ctrl[pos] & HASHMAP_CTRL_EMPTY ? NULL : &map->buckets[pos];
+    pos -= map->capacity;
+    return map->old_ctrl[pos] & HASHMAP_CTRL_EMPTY ? NULL : &map->old_buckets[pos];
+}
+
+bool hashmap_iter_next(HashMapIter* it, const char** key, int* keylen, void** val)
+{
+    HashMap* map = it->map;
+    int end = map->ordered ? map->nentries : map->capacity + map->old_capacity;
+
+    while (it->pos < end) {
+        HashEntry* ent = iter_entry(map, it->pos++);
+        if (!ent)
+            continue;
+        if (key)
+            *key = entry_key(map, ent);
+        if (keylen)
+            *keylen = ent->keylen;
+        if (val)
+            *val = ent->val;
+        return true;
+    }
+    return false;
 }
 
 char* format(const char* fmt, ...)
@@ -156,3 +1106,13 @@ char* format(const char* fmt, ...)
     fclose(out);
     return buf;
 }
+
+void error(const char* fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+    exit(1);
+}
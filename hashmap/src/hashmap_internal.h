@@ -0,0 +1,65 @@
+#ifndef HASHMAP_INTERNAL_H
+#define HASHMAP_INTERNAL_H
+
+#include "hashmap.h"
+#include "hashmap_group.h"
+
+// Helpers shared by the HashMap implementation files. Not part of the
+// public API.
+
+// Initial hash bucket size
+#define INIT_SIZE 16
+
+// Rehash if the usage exceeds 70%.
+#define HIGH_WATERMARK 70
+
+// We'll keep the usage below 50% after rehashing.
+#define LOW_WATERMARK 50
+
+// A snapshot mapped by hashmap_open_mmap. Long keys in its entries are
+// offsets into `keys` instead of pointers.
+struct HashMapImage {
+    void* base;
+    size_t size;
+    const char* keys;
+};
+
+void hashmap_close_image(HashMapImage* image);
+void hashmap_finish_migration(HashMap* map);
+
+// Zeroed memory for bucket and control arrays, following the map's page
+// and NUMA policy (pages.c). Freeing needs the size it was allocated with.
+void* hashmap_alloc_table(HashMap* map, size_t bytes);
+void hashmap_free_table(HashMap* map, void* p, size_t bytes);
+
+// Returns the bytes of an entry's key, which owned maps keep inline when
+// they are short enough.
+static inline const char* entry_key(const HashMap* map, const HashEntry* ent)
+{
+    if (map->owned_keys && ent->keylen <= HASHMAP_INLINE_KEY)
+        return ent->inline_key;
+    if (map->image)
+        return map->image->keys + (uintptr_t)ent->key;
+    return ent->key;
+}
+
+// Returns the entry of bucket `idx` of `buckets`, which is the current or
+// old table. Ordered maps have no bucket array; their buckets point into
+// `entries`.
+static inline HashEntry* bucket_entry(const HashMap* map, HashEntry* buckets, size_t idx)
+{
+    if (map->index)
+        return &map->entries[map->index[idx]];
+    return &buckets[idx];
+}
+
+// Hashes a key with the map's hash function. The default is called
+// directly so that it can be inlined.
+static inline uint64_t hash_key(HashMap* map, const char* key, int keylen)
+{
+    if (map->hash_fn)
+        return map->hash_fn(key, keylen);
+    return hashmap_wyhash_inline(key, keylen);
+}
+
+#endif // HASHMAP_INTERNAL_H
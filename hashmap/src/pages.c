@@ -0,0 +1,126 @@
+#include "hashmap_internal.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// Memory for bucket and control arrays.
+//
+// Small tables, and all tables of maps with the default policy, come from
+// calloc. Tables of at least HUGE_PAGE bytes in maps with a page or NUMA
+// policy are mapped directly instead, so that they can be backed by 2 MiB
+// pages, which cut the TLB misses of random probes into multi-GB tables,
+// and be placed on NUMA nodes. Both are best effort: when huge pages or
+// NUMA are not available the table still gets ordinary pages.
+//
+// Whether a table was mapped only depends on its size and the map's
+// policy, which is why the policy must not change while the map has a
+// table.
+
+#define HUGE_PAGE (2 * 1024 * 1024)
+
+// From <numaif.h>, which is part of libnuma and not always installed.
+#define MPOL_BIND 2
+#define MPOL_INTERLEAVE 3
+
+static bool use_pages(HashMap* map, size_t bytes)
+{
+    return (map->pages != HASHMAP_PAGES_DEFAULT || map->numa != HASHMAP_NUMA_DEFAULT) && bytes >= HUGE_PAGE;
+}
+
+static size_t round_to_huge(size_t bytes)
+{
+    return (bytes + HUGE_PAGE - 1) & ~(size_t)(HUGE_PAGE - 1);
+}
+
+// Returns a HUGE_PAGE-aligned anonymous mapping, so that transparent huge
+// pages can back all of it.
+static void* map_aligned(size_t len)
+{
+    char* p = mmap(NULL, len + HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    char* aligned = (char*)(((uintptr_t)p + HUGE_PAGE - 1) & ~(uintptr_t)(HUGE_PAGE - 1));
+    if (aligned > p)
+        munmap(p, aligned - p);
+    munmap(aligned + len, p + HUGE_PAGE - aligned);
+    return aligned;
+}
+
+// Reads the online node list, e.g. "0-3" or "0,2", into a bitmask.
+static unsigned long online_nodes(void)
+{
+    char buf[256];
+    FILE* f = fopen("/sys/devices/system/node/online", "r");
+    if (!f)
+        return 1;
+    bool ok = fgets(buf, sizeof(buf), f) != NULL;
+    fclose(f);
+
+    unsigned long mask = 0;
+    for (char* s = buf; ok && *s >= '0' && *s <= '9';) {
+        long lo = strtol(s, &s, 10), hi = lo;
+        if (*s == '-')
+            hi = strtol(s + 1, &s, 10);
+        for (long n = lo; n <= hi && n < 64; n++)
+            mask |= 1ul << n;
+        if (*s == ',')
+            s++;
+    }
+    return mask ? mask : 1;
+}
+
+static void place_pages(HashMap* map, void* p, size_t len)
+{
+    unsigned long mask;
+    int mode;
+    if (map->numa == HASHMAP_NUMA_BIND) {
+        if (map->numa_node < 0 || map->numa_node >= 64)
+            error("hashmap: bad numa_node %d", map->numa_node);
+        mask = 1ul << map->numa_node;
+        mode = MPOL_BIND;
+    } else if (map->numa == HASHMAP_NUMA_INTERLEAVE) {
+        mask = online_nodes();
+        mode = MPOL_INTERLEAVE;
+    } else {
+        return;
+    }
+    // Fails harmlessly without NUMA support; the pages stay local.
+    syscall(SYS_mbind, p, len, mode, &mask, 64, 0);
+}
+
+void* hashmap_alloc_table(HashMap* map, size_t bytes)
+{
+    if (!use_pages(map, bytes)) {
+        void* p = calloc(1, bytes);
+        if (!p)
+            error("hashmap: out of memory");
+        return p;
+    }
+
+    size_t len = round_to_huge(bytes);
+    void* p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (map->pages == HASHMAP_PAGES_HUGETLB)
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (p == MAP_FAILED) {
+        p = map_aligned(len);
+        if (!p)
+            error("hashmap: out of memory");
+        if (map->pages != HASHMAP_PAGES_DEFAULT)
+            madvise(p, len, MADV_HUGEPAGE);
+    }
+    // Placement applies to pages faulted in afterwards, which is all of
+    // them: nothing has touched the mapping yet.
+    place_pages(map, p, len);
+    return p;
+}
+
+void hashmap_free_table(HashMap* map, void* p, size_t bytes)
+{
+    if (!p)
+        return;
+    if (use_pages(map, bytes))
+        munmap(p, round_to_huge(bytes));
+    else
+        free(p);
+}
@@ -0,0 +1,185 @@
+#include "hashmap_internal.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+
+// On-disk snapshot of a HashMap.
+//
+// The file is a header followed by the control bytes, the entry array and
+// the bytes of all long keys, each section 64-byte aligned. It is written
+// in the in-memory layout, so hashmap_open_mmap only has to map it and
+// point the map at the sections. Keys of up to HASHMAP_INLINE_KEY bytes
+// are stored inline in the entry, as with owned keys; the key field of
+// longer ones holds an offset into the key section, which keeps the image
+// position independent.
+
+#define SNAPSHOT_MAGIC "KLDHMAP1"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_ALIGN 64
+
+enum {
+    SNAPSHOT_WYHASH,
+    SNAPSHOT_FNV,
+};
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    uint32_t probing;
+    uint32_t hash;
+    int64_t capacity;
+    int64_t used;
+    uint64_t ctrl_off;
+    uint64_t buckets_off;
+    uint64_t keys_off;
+    uint64_t keys_size;
+} SnapshotHeader;
+
+static uint64_t align_up(uint64_t n)
+{
+    return (n + SNAPSHOT_ALIGN - 1) & ~(uint64_t)(SNAPSHOT_ALIGN - 1);
+}
+
+static bool write_at(FILE* out, uint64_t off, const void* buf, size_t len)
+{
+    if (fseeko(out, off, SEEK_SET) != 0)
+        return false;
+    return len == 0 || fwrite(buf, 1, len, out) == len;
+}
+
+int hashmap_save(HashMap* map, const char* path)
+{
+    SnapshotHeader hdr = {};
+    if (!map->hash_fn || map->hash_fn == hashmap_wyhash) {
+        hdr.hash = SNAPSHOT_WYHASH;
+    } else if (map->hash_fn == hashmap_fnv_hash) {
+        hdr.hash = SNAPSHOT_FNV;
+    } else {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    hashmap_finish_migration(map);
+
+    int cap = map->capacity;
+    HashEntry* buckets = calloc(cap ? cap : 1, sizeof(HashEntry));
+    uint64_t keys_size = 0;
+    for (int i = 0; i < cap; i++) {
+        if (map->ctrl[i] & HASHMAP_CTRL_EMPTY)
+            continue;
+        HashEntry* src = bucket_entry(map, map->buckets, i);
+        HashEntry* dst = &buckets[i];
+        dst->keylen = src->keylen;
+        dst->val = src->val;
+        dst->hash = src->hash;
+        if (src->keylen <= HASHMAP_INLINE_KEY) {
+            memcpy(dst->inline_key, entry_key(map, src), src->keylen);
+        } else {
+            dst->key = (char*)(uintptr_t)keys_size;
+            keys_size += src->keylen;
+        }
+    }
+
+    memcpy(hdr.magic, SNAPSHOT_MAGIC, 8);
+    hdr.version = SNAPSHOT_VERSION;
+    hdr.entry_size = sizeof(HashEntry);
+    hdr.probing = map->probing;
+    hdr.capacity = cap;
+    hdr.used = map->used;
+    hdr.ctrl_off = align_up(sizeof(hdr));
+    hdr.buckets_off = align_up(hdr.ctrl_off + cap);
+    hdr.keys_off = align_up(hdr.buckets_off + (uint64_t)cap * sizeof(HashEntry));
+    hdr.keys_size = keys_size;
+
+    FILE* out = fopen(path, "wb");
+    if (!out) {
+        free(buckets);
+        return -1;
+    }
+
+    bool ok = write_at(out, 0, &hdr, sizeof(hdr))
+        && write_at(out, hdr.ctrl_off, map->ctrl, cap)
+        && write_at(out, hdr.buckets_off, buckets, (size_t)cap * sizeof(HashEntry));
+
+    // Key bytes go out in bucket order, matching the offsets above.
+    if (ok && fseeko(out, hdr.keys_off, SEEK_SET) != 0)
+        ok = false;
+    for (int i = 0; ok && i < cap; i++) {
+        if (map->ctrl[i] & HASHMAP_CTRL_EMPTY)
+            continue;
+        HashEntry* ent = bucket_entry(map, map->buckets, i);
+        if (ent->keylen > HASHMAP_INLINE_KEY)
+            ok = fwrite(entry_key(map, ent), 1, ent->keylen, out) == (size_t)ent->keylen;
+    }
+    // Keep the file at least as long as the last section.
+    if (ok && keys_size == 0)
+        ok = ftruncate(fileno(out), hdr.keys_off) == 0;
+
+    free(buckets);
+    int saved_errno = errno;
+    if (fclose(out) != 0)
+        ok = false;
+    else
+        errno = saved_errno;
+    return ok ? 0 : -1;
+}
+
+HashMap* hashmap_open_mmap(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    void* base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    const SnapshotHeader* hdr = base;
+    uint64_t cap = hdr->capacity;
+    bool valid = memcmp(hdr->magic, SNAPSHOT_MAGIC, 8) == 0
+        && hdr->version == SNAPSHOT_VERSION
+        && hdr->entry_size == sizeof(HashEntry)
+        && hdr->probing <= HASHMAP_ROBIN_HOOD
+        && hdr->hash <= SNAPSHOT_FNV
+        && (cap == 0 || (cap >= HASHMAP_GROUP_WIDTH && (cap & (cap - 1)) == 0 && cap <= INT32_MAX))
+        && hdr->ctrl_off + cap <= hdr->buckets_off
+        && hdr->buckets_off + cap * sizeof(HashEntry) <= hdr->keys_off
+        && hdr->keys_off + hdr->keys_size <= (uint64_t)st.st_size;
+    if (!valid) {
+        munmap(base, st.st_size);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    HashMapImage* image = calloc(1, sizeof(HashMapImage));
+    image->base = base;
+    image->size = st.st_size;
+    image->keys = (const char*)base + hdr->keys_off;
+
+    HashMap* map = calloc(1, sizeof(HashMap));
+    map->image = image;
+    map->owned_keys = true;
+    map->probing = hdr->probing;
+    map->hash_fn = hdr->hash == SNAPSHOT_FNV ? hashmap_fnv_hash : NULL;
+    if (cap) {
+        map->ctrl = (uint8_t*)base + hdr->ctrl_off;
+        map->buckets = (HashEntry*)((char*)base + hdr->buckets_off);
+        map->capacity = cap;
+        map->used = hdr->used;
+    }
+    return map;
+}
+
+void hashmap_close_image(HashMapImage* image)
+{
+    munmap(image->base, image->size);
+    free(image);
+}
@@ -1,7 +1,15 @@
 #include <gtest/gtest.h>
+#include <malloc.h>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 extern "C" {
 #include "hashmap.h"
 }
+#include "hashmap.hpp"
 
 // Test insertion operation
 TEST(HashMapTest, InsertOperation)
@@ -137,6 +145,994 @@ TEST(HashMapTest, LimitTest)
     free(map);
 }
 
+// Test that deleted keys stay deleted and can be inserted again, across
+// several rehashes
+TEST(HashMapTest, DeleteAndReinsert)
+{
+    HashMap* map = (HashMap*)calloc(1, sizeof(HashMap));
+
+    for (int i = 0; i < 5000; i++)
+        hashmap_put(map, format("key %d", i), (void*)(size_t)i);
+
+    for (int i = 0; i < 5000; i += 2)
+        hashmap_delete(map, format("key %d", i));
+
+    for (int i = 0; i < 5000; i++) {
+        if (i % 2 == 0)
+            EXPECT_EQ(hashmap_get(map, format("key %d", i)), nullptr);
+        else
+            EXPECT_EQ((size_t)hashmap_get(map, format("key %d", i)), (size_t)i);
+    }
+
+    for (int i = 0; i < 5000; i += 2)
+        hashmap_put(map, format("key %d", i), (void*)(size_t)(i + 1));
+
+    for (int i = 0; i < 5000; i++)
+        EXPECT_EQ((size_t)hashmap_get(map, format("key %d", i)), (size_t)(i % 2 == 0 ? i + 1 : i));
+
+    free(map);
+}
+
+// Test that a map under constant insert/delete churn keeps working
+TEST(HashMapTest, Churn)
+{
+    HashMap* map = (HashMap*)calloc(1, sizeof(HashMap));
+    char** keys = (char**)calloc(100000, sizeof(char*));
+
+    for (int i = 0; i < 100000; i++) {
+        keys[i] = format("key %d", i);
+        hashmap_put(map, keys[i], (void*)(size_t)(i + 1));
+        if (i >= 100)
+            hashmap_delete(map, keys[i - 100]);
+    }
+
+    for (int i = 0; i < 100000; i++) {
+        if (i < 100000 - 100)
+            EXPECT_EQ(hashmap_get(map, keys[i]), nullptr);
+        else
+            EXPECT_EQ((size_t)hashmap_get(map, keys[i]), (size_t)(i + 1));
+    }
+    EXPECT_LE(map->capacity, 1024);
+
+    free(keys);
+    free(map);
+}
+
+// Test that growth keeps the capacity a power of two and entries keep
+// the hash of their key
+TEST(HashMapTest, GrowthKeepsStoredHash)
+{
+    HashMap* map = (HashMap*)calloc(1, sizeof(HashMap));
+
+    for (int i = 0; i < 3000; i++) {
+        hashmap_put(map, format("key %d", i), (void*)(size_t)i);
+        EXPECT_EQ(map->capacity & (map->capacity - 1), 0);
+    }
+
+    // Entries moved by rehash are still reachable under their stored hash
+    int live = 0;
+    for (int i = 0; i < map->capacity; i++) {
+        if (map->ctrl[i] & 0x80)
+            continue;
+        HashEntry* ent = &map->buckets[i];
+        EXPECT_EQ(hashmap_get2(map, ent->key, ent->keylen), ent->val);
+        live++;
+    }
+    EXPECT_EQ(live, 3000);
+
+    free(map);
+}
+
+// Test incremental rehashing: operations keep working while both bucket
+// arrays are live
+TEST(HashMapTest, IncrementalRehash)
+{
+    HashMap* map = (HashMap*)calloc(1, sizeof(HashMap));
+    map->incremental = true;
+
+    bool migrated = false;
+    for (int i = 0; i < 20000; i++) {
+        hashmap_put(map, format("key %d", i), (void*)(size_t)(i + 1));
+        if (map->old_buckets) {
+            migrated = true;
+            // Keys from both tables are visible mid-migration
+            EXPECT_EQ((size_t)hashmap_get(map, "key 0"), 1u);
+            EXPECT_EQ((size_t)hashmap_get(map, format("key %d", i / 2 * 2)), (size_t)(i / 2 * 2 + 1));
+        }
+        // Delete every third odd key once it has been inserted
+        if (i % 6 == 5)
+            hashmap_delete(map, format("key %d", i));
+    }
+    EXPECT_TRUE(migrated);
+
+    for (int i = 0; i < 20000; i++) {
+        if (i % 6 == 5)
+            EXPECT_EQ(hashmap_get(map, format("key %d", i)), nullptr) << i;
+        else
+            EXPECT_EQ((size_t)hashmap_get(map, format("key %d", i)), (size_t)(i + 1)) << i;
+    }
+
+    free(map);
+}
+
+static uint64_t constant_hash(const char*, int)
+{
+    return 42;
+}
+
+// Test that the hash function can be swapped per map, including a
+// degenerate one where every key collides
+TEST(HashMapTest, HashFunctions)
+{
+    HashFn fns[] = { hashmap_fnv_hash, hashmap_wyhash, constant_hash };
+    for (HashFn fn : fns) {
+        HashMap* map = (HashMap*)calloc(1, sizeof(HashMap));
+        map->hash_fn = fn;
+
+        for (int i = 0; i < 500; i++)
+            hashmap_put(map, format("key %d", i), (void*)(size_t)i);
+        for (int i = 0; i < 500; i += 3)
+            hashmap_delete(map, format("key %d", i));
+
+        for (int i = 0; i < 500; i++) {
+            if (i % 3 == 0)
+                EXPECT_EQ(hashmap_get(map, format("key %d", i)), nullptr);
+            else
+                EXPECT_EQ((size_t)hashmap_get(map, format("key %d", i)), (size_t)i);
+        }
+        free(map);
+    }
+
+    EXPECT_EQ(hashmap_fnv_hash("", 0), 0xcbf29ce484222325u);
+    EXPECT_NE(hashmap_wyhash("key 1", 5), hashmap_wyhash("key 2", 5));
+}
+
+// Test that batched lookups agree with one-at-a-time lookups for hits
+// and misses, in both probing modes and while an incremental rehash is in
+// progress
+TEST(HashMapTest, GetBatch)
+{
+    for (int mode = 0; mode < 4; mode++) {
+        HashMap* map = (HashMap*)calloc(1, sizeof(HashMap));
+        map->incremental = mode & 1;
+        map->probing = mode & 2 ? HASHMAP_ROBIN_HOOD : HASHMAP_GROUPS;
+
+        const char* keys[3000];
+        int lens[3000];
+        void* vals[3000];
+
+        hashmap_get_batch(map, keys, lens, 0, vals);
+        for (int i = 0; i < 3000; i++) {
+            keys[i] = format("key %d", i);
+            lens[i] = strlen(keys[i]);
+            if (i % 3 != 0)
+                hashmap_put(map, keys[i], (void*)(size_t)i);
+        }
+
+        hashmap_get_batch(map, keys, lens, 3000, vals);
+        for (int i = 0; i < 3000; i++) {
+            EXPECT_EQ(vals[i], hashmap_get(map, keys[i]));
+            EXPECT_EQ((size_t)vals[i], i % 3 != 0 ? (size_t)i : 0);
+        }
+        free(map);
+    }
+}
+
+// Test Robin Hood probing under TTL-cache style churn: deletes must not
+// leave tombstones and the table must not keep growing
+TEST(HashMapTest, RobinHoodChurn)
+{
+    for (bool incremental : { false, true }) {
+        HashMap* map = (HashMap*)calloc(1, sizeof(HashMap));
+        map->probing = HASHMAP_ROBIN_HOOD;
+        map->incremental = incremental;
+        char** keys = (char**)calloc(100000, sizeof(char*));
+
+        for (int i = 0; i < 100000; i++) {
+            keys[i] = format("key %d", i);
+            hashmap_put(map, keys[i], (void*)(size_t)(i + 1));
+            if (i >= 1000)
+                hashmap_delete(map, keys[i - 1000]);
+            if (i % 997 == 0 && i >= 1000) {
+                EXPECT_EQ((size_t)hashmap_get(map, keys[i - 500]), (size_t)(i - 499));
+                EXPECT_EQ(hashmap_get(map, keys[i - 1000]), nullptr);
+            }
+        }
+
+        for (int i = 0; i < 100000; i++)
+            EXPECT_EQ((size_t)hashmap_get(map, keys[i]), i >= 99000 ? (size_t)(i + 1) : 0) << i;
+
+        int live = 0;
+        for (int i = 0; i < map->capacity; i++) {
+            EXPECT_NE(map->ctrl[i], 0xFE);
+            live += !(map->ctrl[i] & 0x80);
+        }
+        EXPECT_EQ(live, 1000);
+        EXPECT_EQ(map->used, 1000);
+        EXPECT_LE(map->capacity, 4096);
+
+        free(keys);
+        free(map);
+    }
+}
+
+// Test owned keys: the caller's key buffer is reused for every call, so
+// the map must have copied both inline and arena-backed keys
+TEST(HashMapTest, OwnedKeys)
+{
+    for (int mode = 0; mode < 4; mode++) {
+        HashMap map = {};
+        map.owned_keys = true;
+        map.incremental = mode & 1;
+        map.probing = mode & 2 ? HASHMAP_ROBIN_HOOD : HASHMAP_GROUPS;
+        char buf[64];
+
+        // Keys alternate between 5-9 byte inline keys and 40+ byte ones
+        auto key = [&](int i) {
+            if (i % 2)
+                snprintf(buf, sizeof(buf), "k%d", i);
+            else
+                snprintf(buf, sizeof(buf), "a much longer key that lives in the arena %d", i);
+            return buf;
+        };
+
+        for (int i = 0; i < 20000; i++)
+            hashmap_put(&map, key(i), (void*)(size_t)(i + 1));
+        for (int i = 0; i < 20000; i += 4)
+            hashmap_delete(&map, key(i));
+        for (int i = 20000; i < 40000; i++)
+            hashmap_put(&map, key(i), (void*)(size_t)(i + 1));
+
+        for (int i = 0; i < 40000; i++) {
+            size_t want = i < 20000 && i % 4 == 0 ? 0 : i + 1;
+            EXPECT_EQ((size_t)hashmap_get(&map, key(i)), want) << i;
+        }
+
+        hashmap_free(&map);
+        EXPECT_EQ(map.buckets, nullptr);
+        EXPECT_EQ(hashmap_get(&map, key(1)), nullptr);
+        hashmap_put(&map, key(1), (void*)1);
+        EXPECT_EQ((size_t)hashmap_get(&map, key(1)), 1u);
+        hashmap_free(&map);
+    }
+}
+
+// Test that reserving up front means a bulk load never rehashes
+TEST(HashMapTest, Reserve)
+{
+    HashMap map = {};
+    hashmap_reserve(&map, 10000);
+    int cap = map.capacity;
+    HashEntry* buckets = map.buckets;
+
+    for (int i = 0; i < 10000; i++)
+        hashmap_put(&map, format("key %d", i), (void*)(size_t)i);
+    EXPECT_EQ(map.capacity, cap);
+    EXPECT_EQ(map.buckets, buckets);
+
+    // Reserving less than the current size is a no-op
+    hashmap_reserve(&map, 10);
+    EXPECT_EQ(map.buckets, buckets);
+
+    for (int i = 0; i < 10000; i++)
+        EXPECT_EQ((size_t)hashmap_get(&map, format("key %d", i)), (size_t)i);
+    hashmap_free(&map);
+}
+
+// Test that shrinking after a mass delete gives memory back and keeps
+// the remaining keys
+TEST(HashMapTest, ShrinkToFit)
+{
+    for (bool owned : { false, true }) {
+        HashMap map = {};
+        map.owned_keys = owned;
+
+        for (int i = 0; i < 20000; i++)
+            hashmap_put(&map, format("a key long enough for the arena %d", i), (void*)(size_t)i);
+        int cap = map.capacity;
+        for (int i = 100; i < 20000; i++)
+            hashmap_delete(&map, format("a key long enough for the arena %d", i));
+
+        hashmap_shrink_to_fit(&map);
+        EXPECT_LT(map.capacity, cap / 64);
+        EXPECT_EQ(map.used, 100);
+        for (int i = 0; i < 20000; i++)
+            EXPECT_EQ((size_t)hashmap_get(&map, format("a key long enough for the arena %d", i)), i < 100 ? (size_t)i : 0);
+
+        for (int i = 0; i < 100; i++)
+            hashmap_delete(&map, format("a key long enough for the arena %d", i));
+        hashmap_shrink_to_fit(&map);
+        EXPECT_EQ(map.buckets, nullptr);
+    }
+}
+
+// Test that an incremental map with owned keys reclaims the arena bytes
+// of deleted keys while churning through far more keys than it holds
+TEST(HashMapTest, IncrementalArenaChurn)
+{
+    HashMap map = {};
+    map.owned_keys = true;
+    map.incremental = true;
+    char buf[64];
+    auto key = [&](int i) {
+        snprintf(buf, sizeof(buf), "a key long enough for the arena %d", i);
+        return buf;
+    };
+
+    for (int i = 0; i < 200000; i++) {
+        hashmap_put(&map, key(i), (void*)(size_t)(i + 1));
+        if (i >= 1000)
+            hashmap_delete(&map, key(i - 1000));
+    }
+    for (int i = 0; i < 200000; i++)
+        EXPECT_EQ((size_t)hashmap_get(&map, key(i)), i < 199000 ? 0 : (size_t)(i + 1)) << i;
+
+#ifdef HASHMAP_STATS
+    // 1000 live keys of ~40 bytes; without compaction the arena would
+    // hold all 200000.
+    HashMapStats stats;
+    hashmap_stats(&map, &stats);
+    EXPECT_LT(stats.bytes_allocated, 1024u * 1024);
+#endif
+    hashmap_free(&map);
+}
+
+// Test per-map watermarks
+TEST(HashMapTest, Watermarks)
+{
+    HashMap dense = {}, sparse = {};
+    dense.high_watermark = 90;
+    dense.low_watermark = 80;
+    sparse.high_watermark = 40;
+    sparse.low_watermark = 20;
+
+    for (int i = 0; i < 10000; i++) {
+        hashmap_put(&dense, format("key %d", i), (void*)(size_t)i);
+        hashmap_put(&sparse, format("key %d", i), (void*)(size_t)i);
+        // The watermark is checked before each insert
+        EXPECT_LT((dense.used - 1) * 100, dense.capacity * 90);
+        EXPECT_LT((sparse.used - 1) * 100, sparse.capacity * 40);
+    }
+    EXPECT_LT(dense.capacity, sparse.capacity);
+
+    for (int i = 0; i < 10000; i++) {
+        EXPECT_EQ((size_t)hashmap_get(&dense, format("key %d", i)), (size_t)i);
+        EXPECT_EQ((size_t)hashmap_get(&sparse, format("key %d", i)), (size_t)i);
+    }
+    hashmap_free(&dense);
+    hashmap_free(&sparse);
+}
+
+// Test that invalid watermarks fall back to the defaults, including on
+// the paths that size a table from scratch
+TEST(HashMapTest, BadWatermarks)
+{
+    int pairs[][2] = { { 60, -10 }, { 60, 0 }, { 0, -1 }, { 50, 60 }, { 99, 50 }, { -5, 0 } };
+    for (auto& p : pairs) {
+        HashMap map = {};
+        map.high_watermark = p[0];
+        map.low_watermark = p[1];
+        hashmap_reserve(&map, 1000);
+        for (int i = 0; i < 2000; i++)
+            hashmap_put(&map, format("key %d", i), (void*)(size_t)i);
+        EXPECT_LT((map.used - 1) * 100, map.capacity * 70);
+        for (int i = 100; i < 2000; i++)
+            hashmap_delete(&map, format("key %d", i));
+        hashmap_shrink_to_fit(&map);
+        EXPECT_EQ(map.capacity, 256);
+        for (int i = 0; i < 2000; i++)
+            EXPECT_EQ((size_t)hashmap_get(&map, format("key %d", i)), i < 100 ? (size_t)i : 0);
+        hashmap_free(&map);
+    }
+}
+
+// Test that a saved map can be mapped back and queried in place
+TEST(HashMapTest, SaveAndOpenMmap)
+{
+    for (int mode = 0; mode < 4; mode++) {
+        HashMap map = {};
+        map.owned_keys = mode & 1;
+        map.probing = mode & 2 ? HASHMAP_ROBIN_HOOD : HASHMAP_GROUPS;
+        auto key = [](int i) {
+            return i % 2 ? format("k%d", i) : format("a key long enough to go in the key section %d", i);
+        };
+
+        for (int i = 0; i < 5000; i++)
+            hashmap_put(&map, key(i), (void*)(size_t)(i + 1));
+        for (int i = 0; i < 5000; i += 3)
+            hashmap_delete(&map, key(i));
+
+        char path[] = "/tmp/hashmap_snapshotXXXXXX";
+        int fd = mkstemp(path);
+        ASSERT_GE(fd, 0);
+        close(fd);
+        ASSERT_EQ(hashmap_save(&map, path), 0);
+
+        HashMap* image = hashmap_open_mmap(path);
+        ASSERT_NE(image, nullptr);
+        EXPECT_EQ(image->capacity, map.capacity);
+        for (int i = 0; i < 6000; i++) {
+            size_t want = i < 5000 && i % 3 ? i + 1 : 0;
+            EXPECT_EQ((size_t)hashmap_get(image, key(i)), want) << i;
+        }
+
+        hashmap_free(image);
+        free(image);
+        hashmap_free(&map);
+        unlink(path);
+    }
+
+    // An empty map round-trips too; a file that is not a snapshot fails
+    HashMap empty = {};
+    char path[] = "/tmp/hashmap_snapshotXXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+    close(fd);
+    ASSERT_EQ(hashmap_save(&empty, path), 0);
+    HashMap* image = hashmap_open_mmap(path);
+    ASSERT_NE(image, nullptr);
+    EXPECT_EQ(hashmap_get(image, "key"), nullptr);
+    hashmap_free(image);
+    free(image);
+
+    FILE* f = fopen(path, "w");
+    fputs("not a hashmap snapshot, just some text long enough to fill a header", f);
+    fclose(f);
+    EXPECT_EQ(hashmap_open_mmap(path), nullptr);
+    EXPECT_EQ(errno, EINVAL);
+    unlink(path);
+}
+
+// Test counting with hashmap_slot in every mode
+TEST(HashMapTest, Slot)
+{
+    std::vector<std::string> words;
+    for (int i = 0; i < 5000; i++)
+        words.push_back("word " + std::to_string(i));
+
+    for (int mode = 0; mode < 8; mode++) {
+        HashMap map = {};
+        map.incremental = mode & 1;
+        map.probing = mode & 2 ? HASHMAP_ROBIN_HOOD : HASHMAP_GROUPS;
+        map.owned_keys = mode & 4;
+        std::vector<size_t> counts(words.size());
+        std::mt19937_64 rng(mode);
+
+        for (int i = 0; i < 50000; i++) {
+            int w = rng() % words.size();
+            bool inserted;
+            void** slot = hashmap_slot(&map, words[w].data(), words[w].size(), &inserted);
+            EXPECT_EQ(inserted, counts[w] == 0);
+            if (inserted) {
+                EXPECT_EQ(*slot, nullptr);
+            }
+            *slot = (void*)((size_t)*slot + 1);
+            counts[w]++;
+        }
+
+        for (size_t w = 0; w < words.size(); w++)
+            EXPECT_EQ((size_t)hashmap_get(&map, words[w].c_str()), counts[w]) << words[w];
+        hashmap_free(&map);
+    }
+}
+
+// Test that a parallel build matches serial puts, including duplicate
+// keys and keys whose probe leaves their thread's region
+TEST(HashMapTest, BuildParallel)
+{
+    const int n = 100000;
+    std::vector<std::string> words;
+    std::vector<const char*> keys;
+    std::vector<int> lens;
+    std::vector<void*> vals;
+    for (int i = 0; i < n; i++)
+        words.push_back("key " + std::to_string(i % (n * 3 / 4)));
+    for (int i = 0; i < n; i++) {
+        keys.push_back(words[i].data());
+        lens.push_back(words[i].size());
+        vals.push_back((void*)(size_t)(i + 1));
+    }
+
+    for (int nthreads : { 1, 4, 7, 1000 }) {
+        HashMap* map = hashmap_build_parallel(keys.data(), lens.data(), vals.data(), n, nthreads);
+        EXPECT_EQ(map->used, n * 3 / 4);
+        for (int i = 0; i < n * 3 / 4; i++) {
+            size_t want = i + n * 3 / 4 < n ? i + n * 3 / 4 + 1 : i + 1;
+            EXPECT_EQ((size_t)hashmap_get2(map, keys[i], lens[i]), want) << i;
+        }
+
+        // The result takes ordinary updates
+        for (int i = 0; i < 1000; i++)
+            hashmap_delete2(map, keys[i], lens[i]);
+        hashmap_put(map, "new key", (void*)1);
+        EXPECT_EQ(hashmap_get2(map, keys[0], lens[0]), nullptr);
+        EXPECT_EQ((size_t)hashmap_get(map, "new key"), 1u);
+        hashmap_free(map);
+        free(map);
+    }
+
+    HashMap* empty = hashmap_build_parallel(nullptr, nullptr, nullptr, 0, 4);
+    EXPECT_EQ(hashmap_get(empty, "key"), nullptr);
+    hashmap_free(empty);
+    free(empty);
+}
+
+// Test that the Bloom filter never hides a key, through growth, deletes
+// and every mode, and that it turns away most misses
+TEST(HashMapTest, BloomFilter)
+{
+    for (int mode = 0; mode < 8; mode++) {
+        HashMap map = {};
+        map.bloom_bits = 10;
+        map.incremental = mode & 1;
+        map.probing = mode & 2 ? HASHMAP_ROBIN_HOOD : HASHMAP_GROUPS;
+        map.owned_keys = mode & 4;
+
+        for (int i = 0; i < 30000; i++)
+            hashmap_put(&map, format("key %d", i), (void*)(size_t)(i + 1));
+        for (int i = 0; i < 30000; i += 3)
+            hashmap_delete(&map, format("key %d", i));
+        for (int i = 0; i < 30000; i += 2)
+            *hashmap_slot(&map, format("key %d", i), strlen(format("key %d", i)), nullptr) = (void*)(size_t)(i + 1);
+
+        std::vector<const char*> keys;
+        std::vector<int> lens;
+        for (int i = 0; i < 30000; i++) {
+            keys.push_back(format("key %d", i));
+            lens.push_back(strlen(keys.back()));
+        }
+        std::vector<void*> vals(keys.size());
+        hashmap_get_batch(&map, keys.data(), lens.data(), keys.size(), vals.data());
+        for (int i = 0; i < 30000; i++) {
+            size_t want = i % 3 || i % 2 == 0 ? i + 1 : 0;
+            EXPECT_EQ((size_t)hashmap_get(&map, keys[i]), want) << i;
+            EXPECT_EQ((size_t)vals[i], want) << i;
+        }
+
+#ifdef HASHMAP_STATS
+        HashMapStats before, after;
+        hashmap_stats(&map, &before);
+        for (int i = 0; i < 100000; i++)
+            EXPECT_EQ(hashmap_get(&map, format("missing %d", i)), nullptr);
+        hashmap_stats(&map, &after);
+        uint64_t queries = after.bloom_queries - before.bloom_queries;
+        uint64_t rejects = after.bloom_rejects - before.bloom_rejects;
+        uint64_t fps = after.bloom_false_positives - before.bloom_false_positives;
+        EXPECT_EQ(queries, 100000u);
+        EXPECT_EQ(rejects + fps, queries);
+        EXPECT_LT(fps, queries / 50);
+#endif
+        hashmap_free(&map);
+        EXPECT_EQ(map.bloom, nullptr);
+    }
+}
+
+// Test that maps with page and NUMA policies work through growth,
+// incremental migration and shrinking, whether or not the system has
+// huge pages or NUMA
+TEST(HashMapTest, PagePolicies)
+{
+    HashMapPages pages[] = { HASHMAP_PAGES_THP, HASHMAP_PAGES_HUGETLB, HASHMAP_PAGES_DEFAULT };
+    HashMapNuma numa[] = { HASHMAP_NUMA_DEFAULT, HASHMAP_NUMA_BIND, HASHMAP_NUMA_INTERLEAVE };
+
+    for (int p = 0; p < 3; p++) {
+        for (int n = 0; n < 3; n++) {
+            HashMap map = {};
+            map.pages = pages[p];
+            map.numa = numa[n];
+            map.incremental = n == 1;
+
+            for (int i = 0; i < 100000; i++)
+                hashmap_put(&map, format("key %d", i), (void*)(size_t)(i + 1));
+            if (map.pages == HASHMAP_PAGES_THP) {
+                EXPECT_EQ((uintptr_t)map.buckets % (2 << 20), 0u);
+            }
+            for (int i = 1000; i < 100000; i++)
+                hashmap_delete(&map, format("key %d", i));
+            hashmap_shrink_to_fit(&map);
+            for (int i = 0; i < 2000; i++)
+                EXPECT_EQ((size_t)hashmap_get(&map, format("key %d", i)), i < 1000 ? (size_t)i + 1 : 0) << i;
+            hashmap_free(&map);
+        }
+    }
+}
+
+// Test that ordered maps iterate in insertion order through deletes,
+// re-inserts, growth and shrinking
+TEST(HashMapTest, Ordered)
+{
+    for (int mode = 0; mode < 4; mode++) {
+        HashMap map = {};
+        map.ordered = true;
+        map.owned_keys = mode & 1;
+        map.bloom_bits = mode & 2 ? 10 : 0;
+        std::vector<std::string> words;
+        for (int i = 0; i < 20000; i++)
+            words.push_back(i % 3 ? "key " + std::to_string(i) : "a long key for the arena " + std::to_string(i));
+
+        std::vector<int> order;
+        for (int i = 0; i < 20000; i++) {
+            hashmap_put2(&map, words[i].data(), words[i].size(), (void*)(size_t)(i + 1));
+            order.push_back(i);
+        }
+        // Deleting and re-inserting moves a key to the end; updating does not.
+        std::vector<int> kept;
+        for (int i : order)
+            if (i % 5 != 0)
+                kept.push_back(i);
+        for (int i = 0; i < 20000; i += 5)
+            hashmap_delete2(&map, words[i].data(), words[i].size());
+        for (int i = 0; i < 20000; i += 10) {
+            hashmap_put2(&map, words[i].data(), words[i].size(), (void*)(size_t)(i + 1));
+            kept.push_back(i);
+        }
+        for (int i = 1; i < 20000; i += 7)
+            if (i % 10 != 5)
+                hashmap_put2(&map, words[i].data(), words[i].size(), (void*)(size_t)(i + 1));
+
+        for (int round = 0; round < 2; round++) {
+            HashMapIter it;
+            const char* key;
+            int keylen;
+            void* val;
+            size_t n = 0;
+            hashmap_iter_init(&map, &it);
+            while (hashmap_iter_next(&it, &key, &keylen, &val)) {
+                ASSERT_LT(n, kept.size());
+                int i = kept[n++];
+                EXPECT_EQ(std::string(key, keylen), words[i]);
+                EXPECT_EQ((size_t)val, (size_t)i + 1);
+            }
+            EXPECT_EQ(n, kept.size());
+            for (int i = 0; i < 20000; i++)
+                EXPECT_EQ((size_t)hashmap_get2(&map, words[i].data(), words[i].size()), i % 10 == 5 ? 0 : (size_t)i + 1) << i;
+            hashmap_shrink_to_fit(&map);
+            EXPECT_EQ(map.holes, 0);
+            EXPECT_EQ(map.nentries, (int)kept.size());
+        }
+        hashmap_free(&map);
+    }
+
+    HashMap map = {};
+    map.ordered = true;
+    map.probing = HASHMAP_ROBIN_HOOD;
+    EXPECT_DEATH(hashmap_put(&map, "key", NULL), "ordered");
+}
+
+// Test that a put which squeezes holes out of a full entry array keeps
+// the new key in the Bloom filter and its owned copy in the arena
+TEST(HashMapTest, OrderedCompaction)
+{
+    for (int mode = 0; mode < 4; mode++) {
+        HashMap map = {};
+        map.ordered = true;
+        map.owned_keys = mode & 1;
+        map.bloom_bits = mode & 2 ? 10 : 0;
+        std::vector<std::string> words;
+        for (int i = 0; i < 17; i++)
+            words.push_back("a long key for the arena " + std::to_string(i));
+
+        // Fill the initial 16 entries, then leave holes in all but the last
+        // four, so that the 17th put compacts the entries and the arena.
+        for (int i = 0; i < 16; i++)
+            hashmap_put2(&map, words[i].data(), words[i].size(), (void*)(size_t)(i + 1));
+        ASSERT_EQ(map.entries_capacity, 16);
+        for (int i = 0; i < 12; i++)
+            hashmap_delete2(&map, words[i].data(), words[i].size());
+        for (int round = 0; round < 2; round++)
+            hashmap_put2(&map, words[16].data(), words[16].size(), (void*)17);
+        EXPECT_EQ(map.holes, 0);
+        EXPECT_EQ(map.nentries, 5);
+
+        HashMapIter it;
+        const char* key;
+        int keylen;
+        void* val;
+        int i = 12;
+        hashmap_iter_init(&map, &it);
+        while (hashmap_iter_next(&it, &key, &keylen, &val)) {
+            ASSERT_LT(i, 17);
+            EXPECT_EQ(std::string(key, keylen), words[i]);
+            EXPECT_EQ((size_t)val, (size_t)i + 1);
+            i++;
+        }
+        EXPECT_EQ(i, 17);
+        for (int i = 0; i < 17; i++)
+            EXPECT_EQ((size_t)hashmap_get2(&map, words[i].data(), words[i].size()), i < 12 ? 0 : (size_t)i + 1) << i;
+        hashmap_free(&map);
+    }
+}
+
+// Test that iteration visits every key once in all modes, including
+// in the middle of an incremental migration
+TEST(HashMapTest, Iterate)
+{
+    for (int mode = 0; mode < 4; mode++) {
+        HashMap map = {};
+        map.probing = mode == 1 ? HASHMAP_ROBIN_HOOD : HASHMAP_GROUPS;
+        map.incremental = mode == 2;
+        map.ordered = mode == 3;
+        std::unordered_map<std::string, size_t> expected;
+
+        HashMapIter it;
+        hashmap_iter_init(&map, &it);
+        EXPECT_FALSE(hashmap_iter_next(&it, NULL, NULL, NULL));
+
+        for (int i = 0; i < 5000; i++) {
+            hashmap_put(&map, format("key %d", i), (void*)(size_t)i);
+            expected[format("key %d", i)] = i;
+        }
+        for (int i = 0; i < 5000; i += 3) {
+            hashmap_delete(&map, format("key %d", i));
+            expected.erase(format("key %d", i));
+        }
+
+        const char* key;
+        int keylen;
+        void* val;
+        hashmap_iter_init(&map, &it);
+        while (hashmap_iter_next(&it, &key, &keylen, &val)) {
+            auto found = expected.find(std::string(key, keylen));
+            ASSERT_NE(found, expected.end());
+            EXPECT_EQ(found->second, (size_t)val);
+            expected.erase(found);
+        }
+        EXPECT_TRUE(expected.empty());
+        hashmap_free(&map);
+    }
+}
+
+#ifdef HASHMAP_STATS
+// Test that statistics track the table and its probes
+TEST(HashMapTest, Stats)
+{
+    HashMap map = {};
+    HashMapStats stats;
+
+    for (int i = 0; i < 1000; i++)
+        hashmap_put(&map, format("key %d", i), (void*)(size_t)i);
+    for (int i = 0; i < 1000; i++)
+        hashmap_get(&map, format("key %d", i));
+    for (int i = 0; i < 500; i++)
+        hashmap_get(&map, format("missing %d", i));
+    for (int i = 0; i < 100; i++)
+        hashmap_delete(&map, format("key %d", i));
+
+    hashmap_stats(&map, &stats);
+    EXPECT_EQ(stats.live, 900);
+    EXPECT_EQ(stats.live + stats.tombstones, map.used);
+    EXPECT_EQ(stats.capacity, map.capacity);
+    EXPECT_DOUBLE_EQ(stats.load_factor, 900.0 / map.capacity);
+    EXPECT_GT(stats.rehashes, 0u);
+    EXPECT_GT(stats.bytes_allocated, (size_t)map.capacity * sizeof(HashEntry));
+
+    // Every get and delete is a hit; every put and missing get is a miss.
+    uint64_t hits = 0, misses = 0;
+    for (int i = 0; i < HASHMAP_PROBE_HIST; i++) {
+        hits += stats.hit_probes[i];
+        misses += stats.miss_probes[i];
+    }
+    EXPECT_EQ(stats.hit_probes[0], 0u);
+    EXPECT_EQ(hits, 1100u);
+    EXPECT_EQ(misses, 1500u);
+
+    hashmap_free(&map);
+}
+#endif
+
+// Test the C++ template with integer keys against std::unordered_map
+TEST(CppHashMapTest, IntegerKeys)
+{
+    kaleido::HashMap<uint64_t, int> map;
+    std::unordered_map<uint64_t, int> ref;
+    std::mt19937_64 rng(1);
+
+    for (int i = 0; i < 200000; i++) {
+        uint64_t k = rng() % 50000;
+        switch (rng() % 3) {
+        case 0:
+            map.insert_or_assign(k, i);
+            ref[k] = i;
+            break;
+        case 1:
+            EXPECT_EQ(map.erase(k), ref.erase(k) == 1);
+            break;
+        case 2:
+            map.try_emplace(k, i);
+            ref.try_emplace(k, i);
+            break;
+        }
+    }
+
+    EXPECT_EQ(map.size(), (int)ref.size());
+    for (uint64_t k = 0; k < 50000; k++) {
+        auto it = ref.find(k);
+        const int* v = map.find(k);
+        ASSERT_EQ(v != nullptr, it != ref.end()) << k;
+        if (v) {
+            EXPECT_EQ(*v, it->second);
+        }
+    }
+
+    int n = 0;
+    map.for_each([&](uint64_t k, int v) {
+        EXPECT_EQ(ref.at(k), v);
+        n++;
+    });
+    EXPECT_EQ(n, (int)ref.size());
+}
+
+// Test that try_emplace only consumes its arguments on insertion and
+// that every stored key and value is destroyed exactly once
+TEST(CppHashMapTest, TryEmplaceMoves)
+{
+    {
+        kaleido::HashMap<std::string, std::unique_ptr<int>> map;
+        auto p = std::make_unique<int>(1);
+        EXPECT_TRUE(map.try_emplace("one", std::move(p)).second);
+        EXPECT_EQ(p, nullptr);
+
+        auto q = std::make_unique<int>(2);
+        auto [v, inserted] = map.try_emplace("one", std::move(q));
+        EXPECT_FALSE(inserted);
+        EXPECT_NE(q, nullptr);
+        EXPECT_EQ(**v, 1);
+
+        for (int i = 0; i < 10000; i++)
+            map.emplace("key " + std::to_string(i), std::make_unique<int>(i));
+        for (int i = 0; i < 10000; i += 2)
+            EXPECT_TRUE(map.erase("key " + std::to_string(i)));
+        for (int i = 0; i < 10000; i++) {
+            auto* v = map.find("key " + std::to_string(i));
+            if (i % 2)
+                EXPECT_EQ(**v, i);
+            else
+                EXPECT_EQ(v, nullptr);
+        }
+        map["one"] = std::make_unique<int>(3);
+        EXPECT_EQ(**map.find("one"), 3);
+
+        kaleido::HashMap<std::string, std::unique_ptr<int>> moved(std::move(map));
+        EXPECT_EQ(map.size(), 0);
+        EXPECT_EQ(moved.size(), 5001);
+    }
+
+    static int live;
+    struct Counted {
+        int v;
+        Counted(int v)
+            : v(v)
+        {
+            live++;
+        }
+        Counted(Counted&& o)
+            : v(o.v)
+        {
+            live++;
+        }
+        ~Counted() { live--; }
+    };
+    {
+        kaleido::HashMap<int, Counted> map;
+        for (int i = 0; i < 5000; i++)
+            map.try_emplace(i, i);
+        for (int i = 0; i < 5000; i += 3)
+            map.erase(i);
+        EXPECT_EQ(live, map.size());
+        map.clear();
+        EXPECT_EQ(live, 0);
+        for (int i = 0; i < 100; i++)
+            map.try_emplace(i, i);
+    }
+    EXPECT_EQ(live, 0);
+}
+
+// Test padding-free struct keys, which hash and compare as bytes
+TEST(CppHashMapTest, StructKeys)
+{
+    struct Point {
+        int32_t x, y;
+    };
+    kaleido::HashMap<Point, int> map;
+    for (int x = 0; x < 100; x++)
+        for (int y = 0; y < 100; y++)
+            map.try_emplace(Point { x, y }, x * 100 + y);
+    EXPECT_EQ(map.size(), 10000);
+    EXPECT_EQ(*map.find(Point { 42, 7 }), 4207);
+    EXPECT_EQ(map.find(Point { 100, 0 }), nullptr);
+    EXPECT_THROW(map.set_watermarks(50, 60), std::invalid_argument);
+}
+
+// Test the concurrent map with writers on disjoint keys racing readers
+// that look up keys while shards grow
+TEST(ConcurrentHashMapTest, ConcurrentPutGet)
+{
+    ConcurrentHashMap* map = hashmap_concurrent_new(4);
+    const int nthreads = 4, nkeys = 20000;
+
+    std::vector<std::vector<char*>> keys(nthreads);
+    for (int t = 0; t < nthreads; t++)
+        for (int i = 0; i < nkeys; i++)
+            keys[t].push_back(format("key %d-%d", t, i));
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < nthreads; t++) {
+        threads.emplace_back([&, t] {
+            for (int i = 0; i < nkeys; i++) {
+                hashmap_concurrent_put(map, keys[t][i], (void*)(size_t)(i + 1));
+                // Our own earlier keys must stay visible through growth
+                int j = i / 2 & ~3;
+                if ((size_t)hashmap_concurrent_get(map, keys[t][j]) != (size_t)(j + 1))
+                    ADD_FAILURE() << keys[t][j];
+                if (i % 4 == 3)
+                    hashmap_concurrent_delete(map, keys[t][i]);
+            }
+        });
+        threads.emplace_back([&, t] {
+            // Readers see either nothing or the value that was put
+            for (int i = 0; i < nkeys; i++) {
+                size_t v = (size_t)hashmap_concurrent_get(map, keys[t][i]);
+                if (v != 0 && v != (size_t)(i + 1))
+                    ADD_FAILURE() << keys[t][i];
+            }
+        });
+    }
+    for (auto& th : threads)
+        th.join();
+
+    for (int t = 0; t < nthreads; t++) {
+        for (int i = 0; i < nkeys; i++) {
+            if (i % 4 == 3)
+                EXPECT_EQ(hashmap_concurrent_get(map, keys[t][i]), nullptr);
+            else
+                EXPECT_EQ((size_t)hashmap_concurrent_get(map, keys[t][i]), (size_t)(i + 1));
+        }
+    }
+
+    hashmap_concurrent_free(map);
+}
+
+// Test that put/delete churn through many more keys than a shard holds
+// keeps its memory bounded, while a reader keeps finding the keys that
+// stay put
+TEST(ConcurrentHashMapTest, Churn)
+{
+    ConcurrentHashMap* map = hashmap_concurrent_new(1);
+    std::vector<char*> fixed;
+    for (int i = 0; i < 16; i++) {
+        fixed.push_back(format("fixed %d", i));
+        hashmap_concurrent_put(map, fixed[i], (void*)(size_t)(i + 1));
+    }
+
+    std::atomic<bool> done(false);
+    std::thread reader([&] {
+        while (!done)
+            for (int i = 0; i < 16; i++)
+                if ((size_t)hashmap_concurrent_get(map, fixed[i]) != (size_t)(i + 1))
+                    ADD_FAILURE() << fixed[i];
+    });
+
+    // 1016 live keys keep the shard at 2048 buckets, where deletes leave
+    // tombstones often enough to fill the table many times over. Keys live
+    // in a ring; a slot is reused long after its key was deleted.
+    std::vector<std::string> ring(1024);
+    size_t before = mallinfo2().uordblks;
+    for (int i = 0; i < 1000000; i++) {
+        if (i >= 1000)
+            hashmap_concurrent_delete(map, ring[(i - 1000) % 1024].c_str());
+        ring[i % 1024] = "churn " + std::to_string(i);
+        hashmap_concurrent_put(map, ring[i % 1024].c_str(), (void*)(size_t)(i + 1));
+    }
+    size_t after = mallinfo2().uordblks;
+    done = true;
+    reader.join();
+
+    for (int i = 999000; i < 1000000; i++)
+        EXPECT_EQ((size_t)hashmap_concurrent_get(map, ring[i % 1024].c_str()), (size_t)(i + 1));
+    EXPECT_LT(after - before, 1024u * 1024);
+    hashmap_concurrent_free(map);
+}
+
 // Run all tests
 int main(int argc, char** argv)
 {
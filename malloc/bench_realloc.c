@@ -0,0 +1,93 @@
+// Growing buffers with realloc: vectors that double their capacity and
+// string builders that append a few bytes at a time, interleaved as in a
+// real program. Counts how often realloc moved the buffer and how many
+// bytes that copied. Buffers stay below the usual 128 KiB mmap threshold,
+// above which moving a buffer remaps pages instead of copying them. Run
+// it under LD_PRELOAD to measure libmalloc, without to compare with the
+// system allocator:
+//
+//   ./bench_realloc [rounds]
+//   LD_PRELOAD=$PWD/libmalloc.so ./bench_realloc [rounds]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NVECTORS 16
+#define NBUILDERS 16
+#define VECTOR_MAX (64 * 1024)
+#define BUILDER_MAX (64 * 1024)
+
+static long reallocs, moves;
+static double bytes_copied;
+
+// realloc, counting a move as a copy of the old contents.
+static void *grow(void *p, size_t old_size, size_t size) {
+    void *q = realloc(p, size);
+    if (!q) {
+        abort();
+    }
+    reallocs++;
+    if (p && q != p) {
+        moves++;
+        bytes_copied += old_size;
+    }
+    memset((char *)q + old_size, 1, size - old_size);
+    return q;
+}
+
+int main(int argc, char **argv) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 20;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int round = 0; round < rounds; round++) {
+        char *vectors[NVECTORS] = { 0 };
+        size_t vsize[NVECTORS] = { 0 };
+        char *builders[NBUILDERS] = { 0 };
+        size_t bsize[NBUILDERS] = { 0 };
+        unsigned r = round + 1;
+
+        for (int done = 0; done < NVECTORS + NBUILDERS;) {
+            done = 0;
+            for (int i = 0; i < NVECTORS; i++) {
+                if (vsize[i] >= VECTOR_MAX) {
+                    done++;
+                    continue;
+                }
+                size_t size = vsize[i] ? vsize[i] * 2 : 16;
+                vectors[i] = grow(vectors[i], vsize[i], size);
+                vsize[i] = size;
+            }
+            // Builders append several times per vector step.
+            for (int k = 0; k < 64; k++) {
+                for (int i = 0; i < NBUILDERS; i++) {
+                    if (bsize[i] >= BUILDER_MAX) {
+                        continue;
+                    }
+                    r = r * 1103515245 + 12345;
+                    size_t size = bsize[i] + 1 + (r >> 16) % 32;
+                    builders[i] = grow(builders[i], bsize[i], size);
+                    bsize[i] = size;
+                }
+            }
+            for (int i = 0; i < NBUILDERS; i++) {
+                done += bsize[i] >= BUILDER_MAX;
+            }
+        }
+
+        for (int i = 0; i < NVECTORS; i++) {
+            free(vectors[i]);
+        }
+        for (int i = 0; i < NBUILDERS; i++) {
+            free(builders[i]);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%ld reallocs, %ld moved (%.1f%%), %.1f MB copied, %.3f s\n", reallocs, moves,
+        100.0 * moves / reallocs, bytes_copied / 1e6, seconds);
+    return 0;
+}
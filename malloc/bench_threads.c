@@ -0,0 +1,79 @@
+// Multi-threaded malloc/free throughput. Every thread keeps a working set
+// of SLOTS small blocks and replaces a random one per iteration, for 1, 2,
+// 4, ... threads up to the given maximum. Run it under LD_PRELOAD to
+// measure libmalloc, without to compare with the system allocator:
+//
+//   ./bench_threads [max_threads] [ops_per_thread]
+//   LD_PRELOAD=$PWD/libmalloc.so ./bench_threads [max_threads] [ops_per_thread]
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SLOTS 1024
+
+static long ops_per_thread;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *worker(void *arg) {
+    unsigned long r = (unsigned long)arg * 0x9e3779b97f4a7c15ul + 1;
+    void *slots[SLOTS] = { 0 };
+
+    for (long i = 0; i < ops_per_thread; i++) {
+        r ^= r << 13;
+        r ^= r >> 7;
+        r ^= r << 17;
+        int slot = r % SLOTS;
+        free(slots[slot]);
+        // Mostly small sizes, as in typical programs.
+        size_t size = (r >> 32) % 8 ? 16 + (r >> 40) % 240 : 256 + (r >> 40) % 4096;
+        slots[slot] = malloc(size);
+        *(char *)slots[slot] = (char)i;
+    }
+    for (int i = 0; i < SLOTS; i++) {
+        free(slots[i]);
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : 2 * sysconf(_SC_NPROCESSORS_ONLN);
+    ops_per_thread = argc > 2 ? atol(argv[2]) : 2000000;
+    if (max_threads < 1) {
+        max_threads = 1;
+    }
+    pthread_t *threads = malloc(max_threads * sizeof(pthread_t));
+
+    printf("%ld malloc/free pairs per thread\n", ops_per_thread);
+    printf("threads  Mops/s  speedup\n");
+    double base = 0;
+    for (int n = 1;; n *= 2) {
+        if (n > max_threads) {
+            n = max_threads;
+        }
+        double start = now();
+        for (long t = 0; t < n; t++) {
+            pthread_create(&threads[t], NULL, worker, (void *)t);
+        }
+        for (int t = 0; t < n; t++) {
+            pthread_join(threads[t], NULL);
+        }
+        double mops = n * ops_per_thread / (now() - start) / 1e6;
+        if (n == 1) {
+            base = mops;
+        }
+        printf("%7d %7.1f %8.2f\n", n, mops, mops / base);
+        if (n == max_threads) {
+            break;
+        }
+    }
+    free(threads);
+    return 0;
+}
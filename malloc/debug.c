@@ -1,8 +1,19 @@
 #include "libmalloc.h"
 
+// -1 until DEBUG has been read. Looked up once, as __debug is called on
+// every malloc.
+static int enabled = -1;
+
+bool __debug_enabled(void) {
+    if (enabled < 0) {
+        const char *env_debug = getenv("DEBUG");
+        enabled = env_debug != NULL && strcmp(env_debug, "1") == 0;
+    }
+    return enabled;
+}
+
 void __debug(const char *format, ...) {
-    const char *env_debug = getenv("DEBUG");
-    if (env_debug == NULL || strcmp(env_debug, "1") != 0) {
+    if (!__debug_enabled()) {
         return;
     }
 
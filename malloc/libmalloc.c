@@ -1,99 +1,679 @@
+#define _GNU_SOURCE // mremap
 #include "libmalloc.h"
+#include <linux/futex.h>
+#include <pthread.h>
 #include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// Memory comes in chunks mapped from the system, each owned by an arena.
+// Inside a chunk, blocks are laid out back to back, each payload preceded
+// by a header, and a sentinel header that is always in use closes the
+// chunk. The sentinel's `size` is that of the whole chunk.
+//
+// The header doubles as the boundary tag of the block before it: while
+// that block is free, `prev_free` is set and `prev_size` holds its size,
+// so free() finds and merges both neighbours in constant time. Merging
+// stops at the first block of a chunk (`chunk_start`) and the sentinel.
+//
+// Blocks with `is_mmapped` set have a mapping of their own instead and
+// belong to no arena.
+struct arena;
 
 typedef struct header {
-    struct header *next;
+    struct arena *arena;
     size_t size;
-    unsigned is_free;
-    char padding[12];
+    size_t prev_size;
+    unsigned is_free : 1;
+    unsigned prev_free : 1;
+    unsigned is_mmapped : 1;
+    unsigned chunk_start : 1;
+    unsigned is_sentinel : 1;
 } header_t __attribute__((aligned(16)));
 
 #define HEADER_SIZE sizeof(header_t)
+#define ALIGNMENT 16
+#define MIN_BLOCK 16
+#define PAGE_SIZE 4096
 
-header_t *head = NULL; // Head of the free list
-header_t *tail = NULL; // Tail of the free list
+typedef struct chunk {
+    struct chunk *prev;
+    struct chunk *next;
+    size_t size;
+    char padding[8];
+} chunk_t __attribute__((aligned(16)));
+
+// Chunks are at least this large; a request that doesn't fit gets a
+// chunk of its own size.
+#define CHUNK_SIZE (1024 * 1024)
+
+// Requests of at least this many bytes get a mapping of their own, which
+// free unmaps and realloc resizes with mremap. LIBMALLOC_MMAP_THRESHOLD
+// overrides it.
+#define MMAP_THRESHOLD (128 * 1024)
+
+// Free blocks are kept in bins by size class, so that malloc and free
+// don't depend on how many blocks the heap has.
+//
+// Sizes up to SMALL_MAX have a class every SMALL_STEP bytes. Above that
+// each power of two is split into SUBCLASSES classes, up to
+// MAX_CLASS_SIZE, so rounding a request up to its class wastes at most a
+// quarter of it. A free block goes into the bin of the largest class it
+// can hold, and a request is rounded up to its class, so every block in
+// the request's bin or any larger one fits: malloc pops the first block
+// of the first non-empty bin, found through `bin_map`, and splits off
+// what it doesn't need. Larger blocks share one bin that is searched
+// first-fit.
+//
+// A free block links into its bin through its payload, which is at least
+// ALIGNMENT bytes.
+#define SMALL_STEP 16
+#define SMALL_MAX 512
+#define NSMALL (SMALL_MAX / SMALL_STEP)
+#define SUBCLASSES 4
+#define MAX_CLASS_SHIFT 20
+#define MAX_CLASS_SIZE ((size_t)1 << MAX_CLASS_SHIFT)
+#define NBINS (NSMALL + (MAX_CLASS_SHIFT - 9) * SUBCLASSES + 1)
+#define LARGE_BIN (NBINS - 1)
+
+typedef struct free_links {
+    header_t *next;
+    header_t *prev;
+} free_links_t;
+
+#define LINKS(block) ((free_links_t *)((block) + 1))
+
+// Arena locks spin for a while, in case the holder is about to let go,
+// then sleep on a futex, so a preempted holder doesn't have every waiter
+// burn its timeslice. `state` is 0 when unlocked, 1 when locked and 2
+// when locked with possible sleepers, which unlock has to wake. The
+// counters are only updated by the holder.
+#define SPIN_LIMIT 100
+
+typedef struct mutex {
+    atomic_int state;
+    unsigned long acquisitions;
+    unsigned long contended;
+    unsigned long sleeps;
+} mutex_t;
+
+// Threads are spread over the arenas round-robin, one arena per CPU by
+// default or LIBMALLOC_ARENAS. A block goes back to the arena it came
+// from, whichever thread frees it.
+#define MAX_ARENAS 64
+
+typedef struct arena {
+    mutex_t lock;
+    header_t *bins[NBINS];
+    uint64_t bin_map[(NBINS + 63) / 64]; // Bit set for each non-empty bin
+    chunk_t *chunks;
+    int nchunks;
+} arena_t;
+
+#define THREAD_LOCAL __thread __attribute__((tls_model("initial-exec")))
+
+static arena_t arenas[MAX_ARENAS];
+static int narenas;
+static atomic_uint next_arena;
+static THREAD_LOCAL arena_t *thread_arena;
+
+
+static void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield");
+#endif
+}
 
+static bool try_lock(mutex_t *m) {
+    int unlocked = 0;
+    return atomic_compare_exchange_strong_explicit(&m->state, &unlocked, 1,
+        memory_order_acquire, memory_order_relaxed);
+}
 
-atomic_flag global_lock = ATOMIC_FLAG_INIT;
+static void lock(mutex_t *m) {
+    if (try_lock(m)) {
+        m->acquisitions++;
+        return;
+    }
 
-static void lock(atomic_flag* f) {
-  do {
-  // } while (atomic_flag_test_and_set(f));
-  } while (atomic_flag_test_and_set_explicit(f, memory_order_acquire));
+    for (int i = 0; i < SPIN_LIMIT; i++) {
+        cpu_relax();
+        if (atomic_load_explicit(&m->state, memory_order_relaxed) == 0 && try_lock(m)) {
+            m->acquisitions++;
+            m->contended++;
+            return;
+        }
+    }
+
+    // Taking the lock as 2 is conservative: it may make the next unlock
+    // wake a thread that isn't there.
+    unsigned long sleeps = 0;
+    while (atomic_exchange_explicit(&m->state, 2, memory_order_acquire) != 0) {
+        syscall(SYS_futex, &m->state, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+        sleeps++;
+    }
+    m->acquisitions++;
+    m->contended++;
+    m->sleeps += sleeps;
 }
 
-static void unlock(atomic_flag* f) {
-  atomic_flag_clear_explicit(f, memory_order_release);
-    // atomic_flag_clear(f);
+static void unlock(mutex_t *m) {
+    if (atomic_exchange_explicit(&m->state, 0, memory_order_release) == 2) {
+        syscall(SYS_futex, &m->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
 }
 
-// Find a free block
-header_t *find_free_block(size_t size) {
-    header_t *current = head;
-    while (current) {
-        if (current->is_free && current->size >= size) {
-            return current;
+void malloc_lock_stats(lock_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i < narenas; i++) {
+        mutex_t *m = &arenas[i].lock;
+        stats->acquisitions += __atomic_load_n(&m->acquisitions, __ATOMIC_RELAXED);
+        stats->contended += __atomic_load_n(&m->contended, __ATOMIC_RELAXED);
+        stats->sleeps += __atomic_load_n(&m->sleeps, __ATOMIC_RELAXED);
+    }
+}
+
+// With DEBUG=1, report lock contention at exit.
+__attribute__((destructor)) static void report_lock_stats(void) {
+    if (!__debug_enabled()) {
+        return;
+    }
+    lock_stats_t stats;
+    malloc_lock_stats(&stats);
+    __debug("====> locks: %d acquired, %d contended, %d slept\n",
+        (int)stats.acquisitions, (int)stats.contended, (int)stats.sleeps);
+}
+
+static int count_arenas(void) {
+    const char *env = getenv("LIBMALLOC_ARENAS");
+    int n = env ? atoi(env) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) {
+        n = 1;
+    }
+    return n < MAX_ARENAS ? n : MAX_ARENAS;
+}
+
+static arena_t *get_arena(void) {
+    if (!thread_arena) {
+        // Racing threads compute the same value.
+        if (!narenas) {
+            narenas = count_arenas();
         }
-        current = current->next;
+        thread_arena = &arenas[atomic_fetch_add(&next_arena, 1) % narenas];
+    }
+    return thread_arena;
+}
+
+// Class of requests of `size` bytes, a multiple of ALIGNMENT.
+static int bin_index(size_t size) {
+    if (size <= SMALL_MAX) {
+        return (size - 1) / SMALL_STEP;
+    }
+    if (size > MAX_CLASS_SIZE) {
+        return LARGE_BIN;
     }
-    return NULL; // No free block found
+    // size is in (2^shift, 2^(shift+1)], which has SUBCLASSES classes.
+    int shift = 63 - __builtin_clzl(size - 1);
+    return NSMALL + (shift - 9) * SUBCLASSES
+        + ((size - 1 - ((size_t)1 << shift)) >> (shift - 2));
 }
 
-// Request more space from the system
-header_t *request_space(header_t *last, size_t size) {
-    header_t *block = (header_t *)sbrk(0);
-    void *request = sbrk(size + HEADER_SIZE);
-    if (request == (void *)-1) {
-        return NULL; // sbrk failed
+// Rounds a request up to the size of its class.
+static size_t class_size(size_t size) {
+    if (size <= SMALL_MAX) {
+        return (size + SMALL_STEP - 1) & ~(size_t)(SMALL_STEP - 1);
     }
+    if (size > MAX_CLASS_SIZE) {
+        return (size + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+    }
+    int shift = 63 - __builtin_clzl(size - 1);
+    size_t step = (size_t)1 << (shift - 2);
+    return (size + step - 1) & ~(step - 1);
+}
 
-    if (last) { // NULL on first request
-        last->next = block;
+// Smallest block size of bin `i`.
+static size_t bin_size(int i) {
+    if (i < NSMALL) {
+        return (size_t)(i + 1) * SMALL_STEP;
     }
+    i -= NSMALL;
+    int shift = 9 + i / SUBCLASSES;
+    return ((size_t)1 << shift) + ((size_t)(i % SUBCLASSES + 1) << (shift - 2));
+}
 
+// Bin of a free block of `size` bytes: the largest class it can hold.
+static int free_bin(size_t size) {
+    int i = bin_index(size);
+    if (i != LARGE_BIN && bin_size(i) > size) {
+        i--;
+    }
+    return i;
+}
+
+static void bin_push(arena_t *arena, header_t *block) {
+    int i = free_bin(block->size);
+    header_t **bin = &arena->bins[i];
+    LINKS(block)->next = *bin;
+    LINKS(block)->prev = NULL;
+    if (*bin) {
+        LINKS(*bin)->prev = block;
+    }
+    *bin = block;
+    arena->bin_map[i / 64] |= (uint64_t)1 << (i % 64);
+}
+
+static void bin_remove(arena_t *arena, header_t *block) {
+    free_links_t *links = LINKS(block);
+    if (links->prev) {
+        LINKS(links->prev)->next = links->next;
+    } else {
+        int i = free_bin(block->size);
+        arena->bins[i] = links->next;
+        if (!arena->bins[i]) {
+            arena->bin_map[i / 64] &= ~((uint64_t)1 << (i % 64));
+        }
+    }
+    if (links->next) {
+        LINKS(links->next)->prev = links->prev;
+    }
+}
+
+// First non-empty bin from `i` on, or -1.
+static int next_bin(arena_t *arena, int i) {
+    for (int w = i / 64; w < (NBINS + 63) / 64; w++) {
+        uint64_t bits = arena->bin_map[w];
+        if (w == i / 64) {
+            bits &= ~(uint64_t)0 << (i % 64);
+        }
+        if (bits) {
+            return w * 64 + __builtin_ctzl(bits);
+        }
+    }
+    return -1;
+}
+
+static header_t *next_block(header_t *block) {
+    return (header_t *)((char *)(block + 1) + block->size);
+}
+
+// Record in the block after `block` whether `block` is free.
+static void set_boundary_tag(header_t *block) {
+    header_t *next = next_block(block);
+    next->prev_free = block->is_free;
+    next->prev_size = block->size;
+}
+
+// Cut a block in use down to `size` bytes if the rest can make a block
+// of its own, which becomes free.
+static void split_block(header_t *block, size_t size) {
+    if (block->size < size + HEADER_SIZE + MIN_BLOCK) {
+        return;
+    }
+    // `rest` lies in what was payload, so every field, including any
+    // flag not named here, has to be written.
+    header_t *rest = (header_t *)((char *)(block + 1) + size);
+    *rest = (header_t){
+        .arena = block->arena,
+        .size = block->size - size - HEADER_SIZE,
+        .is_free = 1,
+    };
     block->size = size;
-    block->is_free = 0;
-    block->next = NULL;
+    // Blocks next to a free one are never free themselves, so there is
+    // nothing to merge `rest` with.
+    set_boundary_tag(rest);
+    bin_push(rest->arena, rest);
+}
+
+// Find a free block of at least `size` bytes, a class size, and take it
+// out of its bin, trimmed to `size`.
+header_t *find_free_block(arena_t *arena, size_t size) {
+    int i = next_bin(arena, bin_index(size));
+    if (i < 0) {
+        return NULL; // No free block found
+    }
 
+    header_t *current = arena->bins[i];
+    if (i == LARGE_BIN) {
+        while (current && current->size < size) {
+            current = LINKS(current)->next;
+        }
+        if (!current) {
+            return NULL;
+        }
+    }
+    bin_remove(arena, current);
+    current->is_free = 0;
+    set_boundary_tag(current);
+    split_block(current, size);
+    return current;
+}
+
+// Map a new chunk with room for a block of `size` bytes and return its
+// only block, in use.
+static header_t *new_chunk(arena_t *arena, size_t size) {
+    size_t len = (size + sizeof(chunk_t) + 2 * HEADER_SIZE + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+    if (len < CHUNK_SIZE) {
+        len = CHUNK_SIZE;
+    }
+    chunk_t *chunk = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (chunk == MAP_FAILED) {
+        return NULL;
+    }
+    chunk->size = len;
+    chunk->prev = NULL;
+    chunk->next = arena->chunks;
+    if (arena->chunks) {
+        arena->chunks->prev = chunk;
+    }
+    arena->chunks = chunk;
+    arena->nchunks++;
+
+    // Fresh mappings are zero, so only the set fields need writing.
+    header_t *block = (header_t *)(chunk + 1);
+    block->arena = arena;
+    block->size = len - sizeof(chunk_t) - 2 * HEADER_SIZE;
+    block->chunk_start = 1;
+    header_t *sentinel = next_block(block);
+    sentinel->arena = arena;
+    sentinel->size = len;
+    sentinel->is_sentinel = 1;
     return block;
 }
 
-void *malloc(size_t size) {
-    if (size <= 0) {
+// Unmap a chunk whose blocks have all been freed, unless it is the
+// arena's last one.
+static bool release_chunk(arena_t *arena, header_t *block) {
+    if (!block->chunk_start || !next_block(block)->is_sentinel || arena->nchunks == 1) {
+        return false;
+    }
+    chunk_t *chunk = (chunk_t *)block - 1;
+    if (chunk->prev) {
+        chunk->prev->next = chunk->next;
+    } else {
+        arena->chunks = chunk->next;
+    }
+    if (chunk->next) {
+        chunk->next->prev = chunk->prev;
+    }
+    arena->nchunks--;
+    munmap(chunk, chunk->size);
+    return true;
+}
+
+// Mark a block free, merge it with free neighbours and put the result
+// in its bin. Called with the block's arena locked.
+static void release_block(header_t *block) {
+    arena_t *arena = block->arena;
+    block->is_free = 1;
+
+    header_t *next = next_block(block);
+    if (next->is_free) {
+        bin_remove(arena, next);
+        block->size += HEADER_SIZE + next->size;
+    }
+    if (block->prev_free) {
+        header_t *prev = (header_t *)((char *)block - block->prev_size - HEADER_SIZE);
+        bin_remove(arena, prev);
+        prev->size += HEADER_SIZE + block->size;
+        block = prev;
+    }
+
+    if (release_chunk(arena, block)) {
+        return;
+    }
+    set_boundary_tag(block);
+    bin_push(arena, block);
+}
+
+// Extend the chunk of `block`, the last block before the sentinel, in
+// place so that the block grows to at least `size` bytes. Fails if the
+// address space after the chunk is taken.
+static bool grow_chunk(header_t *block, size_t size) {
+    header_t *sentinel = next_block(block);
+    chunk_t *chunk = (chunk_t *)((char *)(sentinel + 1) - sentinel->size);
+    size_t len = (chunk->size + size - block->size + CHUNK_SIZE - 1) & ~(size_t)(CHUNK_SIZE - 1);
+    if (mremap(chunk, chunk->size, len, 0) == MAP_FAILED) {
+        return false;
+    }
+    chunk->size = len;
+
+    block->size = (char *)chunk + len - HEADER_SIZE - (char *)(block + 1);
+    sentinel = next_block(block);
+    *sentinel = (header_t){
+        .arena = block->arena,
+        .size = len,
+        .is_sentinel = 1,
+    };
+    return true;
+}
+
+// Grow a block in use to `size` bytes, a class size, without moving it:
+// by taking over the free block after it, and if that isn't enough and
+// the block ends its chunk, by extending the chunk.
+static bool grow_in_place(header_t *block, size_t size) {
+    arena_t *arena = block->arena;
+    size_t old_size = block->size;
+    lock(&arena->lock);
+
+    header_t *next = next_block(block);
+    if (next->is_free) {
+        bin_remove(arena, next);
+        block->size += HEADER_SIZE + next->size;
+        next = next_block(block);
+    }
+    if (block->size < size && next->is_sentinel) {
+        grow_chunk(block, size);
+    }
+    // Whatever was absorbed beyond `size`, or all of it if that wasn't
+    // enough, is split off again.
+    bool grown = block->size >= size;
+    set_boundary_tag(block);
+    split_block(block, grown ? size : old_size);
+
+    unlock(&arena->lock);
+    return grown;
+}
+
+// Take a free block of `size` bytes, a class size, from the arena's bins
+// or a new chunk. Called with the arena locked.
+static header_t *take_block(arena_t *arena, size_t size) {
+    header_t *block = find_free_block(arena, size);
+    if (block) {
+        return block;
+    }
+
+    block = new_chunk(arena, size);
+    if (block) {
+        split_block(block, size);
+    }
+    return block;
+}
+
+// Per-thread caches.
+//
+// Each thread keeps up to TCACHE_COUNT free blocks of every class up to
+// TCACHE_MAX_SIZE, singly linked through their payload. malloc and free
+// of those sizes only touch the calling thread's lists and take no lock.
+// An empty list is refilled with up to TCACHE_BATCH blocks under the
+// lock, and a full one gives half of its blocks back to the bins. Cached
+// blocks stay in use as far as the heap is concerned. A thread's cache
+// goes back to the bins when the thread exits.
+#define TCACHE_MAX_SHIFT 15
+#define TCACHE_MAX_SIZE ((size_t)1 << TCACHE_MAX_SHIFT)
+#define TCACHE_BINS (NSMALL + (TCACHE_MAX_SHIFT - 9) * SUBCLASSES)
+#define TCACHE_COUNT 64
+#define TCACHE_BATCH 16
+#define TCACHE_REFILL_BYTES (64 * 1024)
+
+typedef struct tcache_bin {
+    header_t *head;
+    int count;
+} tcache_bin_t;
+
+static THREAD_LOCAL tcache_bin_t tcache[TCACHE_BINS];
+static THREAD_LOCAL bool tcache_registered;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+// Give the first `n` blocks of a cache list back to the bins of their
+// arenas. Runs of blocks from the same arena share one lock.
+static void tcache_flush(tcache_bin_t *tb, int n) {
+    arena_t *locked = NULL;
+    for (; n > 0 && tb->head; n--) {
+        header_t *block = tb->head;
+        tb->head = LINKS(block)->next;
+        tb->count--;
+        if (block->arena != locked) {
+            if (locked) {
+                unlock(&locked->lock);
+            }
+            locked = block->arena;
+            lock(&locked->lock);
+        }
+        release_block(block);
+    }
+    if (locked) {
+        unlock(&locked->lock);
+    }
+}
+
+static void tcache_destroy(void *unused) {
+    (void)unused;
+    // Later destructors may still allocate and register again.
+    tcache_registered = false;
+    for (int i = 0; i < TCACHE_BINS; i++) {
+        if (tcache[i].head) {
+            tcache_flush(&tcache[i], tcache[i].count);
+        }
+    }
+}
+
+static void tcache_create_key(void) {
+    pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+// Arrange for tcache_destroy to run when the thread exits. Key
+// destructors only run for non-NULL values.
+static void tcache_register(void) {
+    tcache_registered = true;
+    pthread_once(&tcache_once, tcache_create_key);
+    pthread_setspecific(tcache_key, (void *)1);
+}
+
+static void tcache_refill(tcache_bin_t *tb, size_t size) {
+    int n = TCACHE_REFILL_BYTES / (size + HEADER_SIZE);
+    if (n > TCACHE_BATCH) {
+        n = TCACHE_BATCH;
+    }
+    if (n < 1) {
+        n = 1;
+    }
+
+    arena_t *arena = get_arena();
+    lock(&arena->lock);
+    for (; n > 0; n--) {
+        header_t *block = take_block(arena, size);
+        if (!block) {
+            break;
+        }
+        LINKS(block)->next = tb->head;
+        tb->head = block;
+        tb->count++;
+    }
+    unlock(&arena->lock);
+
+    // May allocate, so only once the lists are consistent.
+    if (!tcache_registered) {
+        tcache_register();
+    }
+}
+
+static header_t *tcache_pop(int i, size_t size) {
+    tcache_bin_t *tb = &tcache[i];
+    if (!tb->head) {
+        tcache_refill(tb, size);
+        if (!tb->head) {
+            return NULL;
+        }
+    }
+    header_t *block = tb->head;
+    tb->head = LINKS(block)->next;
+    tb->count--;
+    return block;
+}
+
+static void tcache_push(int i, header_t *block) {
+    tcache_bin_t *tb = &tcache[i];
+    LINKS(block)->next = tb->head;
+    tb->head = block;
+    if (++tb->count > TCACHE_COUNT) {
+        tcache_flush(tb, TCACHE_COUNT / 2);
+    }
+    // Threads that only free need flushing on exit too.
+    if (!tcache_registered) {
+        tcache_register();
+    }
+}
+
+static size_t mmap_threshold;
+
+static size_t get_mmap_threshold(void) {
+    if (!mmap_threshold) {
+        const char *env = getenv("LIBMALLOC_MMAP_THRESHOLD");
+        size_t threshold = env ? strtoull(env, NULL, 0) : 0;
+        mmap_threshold = threshold ? threshold : MMAP_THRESHOLD;
+    }
+    return mmap_threshold;
+}
+
+static size_t mapping_size(size_t size) {
+    return (size + HEADER_SIZE + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+}
+
+static header_t *mmap_block(size_t size) {
+    size_t len = mapping_size(size);
+    header_t *block = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (block == MAP_FAILED) {
+        return NULL;
+    }
+    block->size = len - HEADER_SIZE;
+    block->is_mmapped = 1;
+    return block;
+}
+
+// Allocate a block for malloc and calloc, which both need its header.
+static header_t *alloc_block(size_t size) {
+    if (size <= 0 || size > PTRDIFF_MAX) {
         return NULL;
     }
 
-    lock(&global_lock);
     header_t *block;
+    if (size >= get_mmap_threshold()) {
+        __debug("====> malloc %d bytes => mmap\n", size);
+        return mmap_block(size);
+    }
+
     size_t prev_size = size;
-    size = ((size + (sizeof(void *) - 1)) & (~(sizeof(void *) - 1)));
+    size = class_size(size);
     __debug("====> malloc %d bytes => %d\n", prev_size, size);
 
-    if (!head) {
-        block = request_space(NULL, size);
-        if (!block) {
-            unlock(&global_lock);
-            return NULL;
-        }
-        head = block;
-        tail = block;
+    int i = bin_index(size);
+    if (i < TCACHE_BINS) {
+        block = tcache_pop(i, size);
     } else {
-        header_t *last = head;
-        block = find_free_block(size);
-        if (!block) {
-            block = request_space(tail, size);
-            if (!block) {
-                unlock(&global_lock);
-                return NULL;
-            }
-            tail = block;
-        } else {
-            block->is_free = 0;
-        }
+        arena_t *arena = get_arena();
+        lock(&arena->lock);
+        block = take_block(arena, size);
+        unlock(&arena->lock);
     }
+    return block;
+}
 
-    unlock(&global_lock);
-    return (block + 1);
+void *malloc(size_t size) {
+    header_t *block = alloc_block(size);
+    return block ? block + 1 : NULL;
 }
 
 void free(void *ptr) {
@@ -101,21 +681,36 @@ void free(void *ptr) {
         return;
     }
 
-    lock(&global_lock);
+    // Split blocks may be a little larger than their class; any request
+    // of the largest class the block holds fits.
     header_t *block = (header_t *)ptr - 1;
-    block->is_free = 1;
+    if (block->is_mmapped) {
+        munmap(block, block->size + HEADER_SIZE);
+        return;
+    }
+    int i = free_bin(block->size);
+    if (i < TCACHE_BINS) {
+        tcache_push(i, block);
+        return;
+    }
 
-    unlock(&global_lock);
-    return;
+    arena_t *arena = block->arena;
+    lock(&arena->lock);
+    release_block(block);
+    unlock(&arena->lock);
 }
 
 void *calloc(size_t num, size_t size) {
     size_t total_size = num * size;
-    void *ptr = malloc(total_size);
-    if (ptr != NULL) {
-        memset(ptr, 0, total_size);
+    header_t *block = alloc_block(total_size);
+    if (block == NULL) {
+        return NULL;
+    }
+    // Fresh mappings are zero already.
+    if (!block->is_mmapped) {
+        memset(block + 1, 0, total_size);
     }
-    return ptr;
+    return block + 1;
 }
 
 void *realloc(void *ptr, size_t size) {
@@ -129,7 +724,27 @@ void *realloc(void *ptr, size_t size) {
     }
 
     header_t *block = (header_t *)ptr - 1;
-    if (block->size >= size) {
+    if (block->is_mmapped && size >= get_mmap_threshold()) {
+        // The kernel moves the pages, nothing is copied.
+        size_t len = mapping_size(size);
+        if (len == block->size + HEADER_SIZE) {
+            return ptr;
+        }
+        header_t *moved = mremap(block, block->size + HEADER_SIZE, len, MREMAP_MAYMOVE);
+        if (moved == MAP_FAILED) {
+            return NULL;
+        }
+        moved->size = len - HEADER_SIZE;
+        return moved + 1;
+    }
+    // A mapping shrunk below the threshold moves to the heap so it stops
+    // pinning its pages.
+    if (block->size >= size && !block->is_mmapped) {
+        return ptr;
+    }
+    // Copying is the last resort for blocks that stay on the heap.
+    if (!block->is_mmapped && size < get_mmap_threshold()
+        && grow_in_place(block, class_size(size))) {
         return ptr;
     }
 
@@ -138,8 +753,17 @@ void *realloc(void *ptr, size_t size) {
         return NULL;
     }
 
-    memcpy(new_ptr, ptr, block->size);
-    free(ptr);
+    memcpy(new_ptr, ptr, block->size < size ? block->size : size);
+    if (block->is_mmapped) {
+        free(ptr);
+    } else {
+        // Straight back to the arena rather than the thread cache, so
+        // that the block before it can grow into the space.
+        arena_t *arena = block->arena;
+        lock(&arena->lock);
+        release_block(block);
+        unlock(&arena->lock);
+    }
 
     return new_ptr;
 }
@@ -5,6 +5,7 @@
 #include <stdarg.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdatomic.h>
@@ -12,5 +13,16 @@
 #define MAX_BUFFER_SIZE 1024
 
 void __debug(const char *format, ...);
+bool __debug_enabled(void);
+
+// Arena lock counters, summed over all arenas. They are read without
+// taking the locks, so they may lag behind threads still allocating.
+typedef struct lock_stats {
+    unsigned long acquisitions;
+    unsigned long contended; // Found the lock taken
+    unsigned long sleeps;    // Futex waits while contended
+} lock_stats_t;
+
+void malloc_lock_stats(lock_stats_t *stats);
 
 #endif